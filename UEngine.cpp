@@ -11,13 +11,15 @@ uint32_t findMemoryType(VkPhysicalDevice phyDevice, uint32_t typeFilter, VkMemor
     VkPhysicalDeviceMemoryProperties memProperties;
     vkGetPhysicalDeviceMemoryProperties(phyDevice, &memProperties);
     for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-        if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & props)) {
+        if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & props) == props) {
             return i;
         }
     }
     throw std::runtime_error("failed to find suitable memory type");
 }
-void createBuffer(VkDevice device, VkPhysicalDevice phyDevice, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+void createBuffer(MemoryAllocator *allocator, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, MemoryAllocation& bufferMemory, MemoryStrategy strategy) {
+    VkDevice device = allocator->getDevice();
+
     VkBufferCreateInfo bufferInfo{};
     bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     bufferInfo.size = size;
@@ -31,29 +33,33 @@ void createBuffer(VkDevice device, VkPhysicalDevice phyDevice, VkDeviceSize size
     VkMemoryRequirements memRequirements;
     vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(phyDevice, memRequirements.memoryTypeBits, properties);
-
-    if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate buffer memory!");
-    }
+    bufferMemory = allocator->allocate(memRequirements, properties, true, strategy);
 
-    vkBindBufferMemory(device, buffer, bufferMemory, 0);
+    vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);
+}
+void destroyBuffer(MemoryAllocator *allocator, VkBuffer& buffer, MemoryAllocation& bufferMemory) {
+    vkDestroyBuffer(allocator->getDevice(), buffer, nullptr);
+    allocator->free(bufferMemory);
+    buffer = VK_NULL_HANDLE;
 }
 void copyBuffer(VkDevice device, VkCommandPool pool, VkQueue queue, VkBuffer source, VkBuffer dstBuffer, VkDeviceSize size) {
-    VkCommandBuffer commandBuffer = beginSingleCommands(device, pool);
-
     VkBufferCopy copyRegion {};
     copyRegion.srcOffset = 0;
     copyRegion.dstOffset = 0;
     copyRegion.size = size;
-    vkCmdCopyBuffer(commandBuffer, source, dstBuffer, 1, &copyRegion);
+
+    copyBufferRegions(device, pool, queue, source, dstBuffer, {copyRegion});
+}
+void copyBufferRegions(VkDevice device, VkCommandPool pool, VkQueue queue, VkBuffer source, VkBuffer dstBuffer, std::vector<VkBufferCopy> regions) {
+    VkCommandBuffer commandBuffer = beginSingleCommands(device, pool);
+
+    vkCmdCopyBuffer(commandBuffer, source, dstBuffer, static_cast<uint32_t>(regions.size()), regions.data());
 
     endSigleTimeCommands(queue, device, pool, commandBuffer);
 }
-void createImage( VkDevice device, VkPhysicalDevice phyDevice, uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags memProps, VkImage image, VkDeviceMemory imageMemory) {
+void createImage(MemoryAllocator *allocator, uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags memProps, VkImage& image, MemoryAllocation& imageMemory) {
+    VkDevice device = allocator->getDevice();
+
     VkImageCreateInfo imageInfo {};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -70,22 +76,15 @@ void createImage( VkDevice device, VkPhysicalDevice phyDevice, uint32_t width, u
     imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
     if (vkCreateImage(device, &imageInfo, nullptr, &image) != VK_SUCCESS) {
-        std::runtime_error("failed to create image");
+        throw std::runtime_error("failed to create image");
     }
 
     VkMemoryRequirements memReqs;
     vkGetImageMemoryRequirements(device, image, &memReqs);
 
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memReqs.size;
-    allocInfo.memoryTypeIndex = findMemoryType(phyDevice, memReqs.memoryTypeBits, memProps);
-
-    if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate memory for the texture");
-    }
+    imageMemory = allocator->allocate(memReqs, memProps, tiling == VK_IMAGE_TILING_LINEAR);
 
-    vkBindImageMemory(device, image, imageMemory, 0);
+    vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
 }
 VkCommandBuffer beginCommands(VkDevice device, VkCommandPool commandPool, VkCommandBufferUsageFlags flags) {
     VkCommandBufferAllocateInfo allocInfo {};
@@ -118,6 +117,11 @@ void endSigleTimeCommands ( VkQueue graphicsQueue, VkDevice device, VkCommandPoo
 void transitionImageLayout ( VkQueue queue, VkDevice device, VkCommandPool pool, VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout) {
     VkCommandBuffer commandBuffer = beginSingleCommands(device, pool);
 
+    recordImageTransition(commandBuffer, image, format, oldLayout, newLayout);
+
+    endSigleTimeCommands(queue, device, pool, commandBuffer);
+}
+void recordImageTransition(VkCommandBuffer commandBuffer, VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout) {
     VkImageMemoryBarrier barrier {};
     barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
     barrier.oldLayout = oldLayout;
@@ -173,21 +177,24 @@ void transitionImageLayout ( VkQueue queue, VkDevice device, VkCommandPool pool,
         0, nullptr,
         1, &barrier
     );
-
-    endSigleTimeCommands(queue, device, pool, commandBuffer);
 }
-void copyBufferToImage( VkDevice device, VkCommandPool pool, VkQueue queue, uint32_t width, uint32_t height, VkBuffer buffer, VkImage image) {
+void copyBufferToImage( VkDevice device, VkCommandPool pool, VkQueue queue, uint32_t width, uint32_t height, VkBuffer buffer, VkImage image, VkDeviceSize bufferOffset) {
     VkCommandBuffer cmdBuffer = beginSingleCommands(device, pool);
 
+    recordBufferToImage(cmdBuffer, width, height, buffer, image, bufferOffset);
+
+    endSigleTimeCommands(queue, device, pool, cmdBuffer);
+}
+void recordBufferToImage(VkCommandBuffer cmdBuffer, uint32_t width, uint32_t height, VkBuffer buffer, VkImage image, VkDeviceSize bufferOffset, uint32_t firstRow) {
     VkBufferImageCopy region {};
-    region.bufferOffset = 0;
+    region.bufferOffset = bufferOffset;
     region.bufferRowLength = 0;
     region.bufferImageHeight = 0;
     region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     region.imageSubresource.mipLevel = 0;
     region.imageSubresource.baseArrayLayer = 0;
     region.imageSubresource.layerCount = 1;
-    region.imageOffset = {0,0,0};
+    region.imageOffset = {0, static_cast<int32_t>(firstRow), 0};
     region.imageExtent = {
         width,
         height,
@@ -195,8 +202,6 @@ void copyBufferToImage( VkDevice device, VkCommandPool pool, VkQueue queue, uint
     };
 
     vkCmdCopyBufferToImage(cmdBuffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-
-    endSigleTimeCommands(queue, device, pool, cmdBuffer);
 }
 namespace UniverseGen {
     VkImageView createImageView( VkDevice device, VkImage image, VkFormat format, VkImageAspectFlags flags) {
@@ -525,7 +530,8 @@ std::vector<char> readFile(const std::string& path) {
 MImage::MImage() {
     this->imageView = VK_NULL_HANDLE;
     this->image = VK_NULL_HANDLE;
-    this->imageMemory = VK_NULL_HANDLE;
+    this->imageMemory = MemoryAllocation {};
+    this->allocator = nullptr;
 };
 MImage::MImage( uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags memProps, VkImageAspectFlags flags) {
     this->width = width;
@@ -538,44 +544,15 @@ MImage::MImage( uint32_t width, uint32_t height, VkFormat format, VkImageTiling
     this->viewFlags = flags;
     this->imageView = VK_NULL_HANDLE;
     this->image = VK_NULL_HANDLE;
-    this->imageMemory = VK_NULL_HANDLE;
+    this->imageMemory = MemoryAllocation {};
+    this->allocator = nullptr;
 }
 VkImage MImage::getImage(void) {
     return image;
 }
-void MImage::create(VkDevice device, VkPhysicalDevice phyDevice) {
-    VkImageCreateInfo imageInfo {};
-    imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    imageInfo.imageType = VK_IMAGE_TYPE_2D;
-    imageInfo.extent.width = width;
-    imageInfo.extent.height = height;
-    imageInfo.extent.depth = 1;
-    imageInfo.mipLevels = 1;
-    imageInfo.arrayLayers = 1;
-    imageInfo.format = format;
-    imageInfo.tiling = tiling;
-    imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    imageInfo.usage = usage;
-    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-    imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    if (vkCreateImage(device, &imageInfo, nullptr, &image) != VK_SUCCESS) {
-        std::runtime_error("failed to create image");
-    }
-
-    VkMemoryRequirements memReqs;
-    vkGetImageMemoryRequirements(device, image, &memReqs);
-
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memReqs.size;
-    allocInfo.memoryTypeIndex = findMemoryType(phyDevice, memReqs.memoryTypeBits, memProps);
-
-    if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
-        throw std::runtime_error("failed to allocate memory for the texture");
-    }
-
-    vkBindImageMemory(device, image, imageMemory, 0);
+void MImage::create(MemoryAllocator *allocator) {
+    this->allocator = allocator;
+    createImage(allocator, width, height, format, tiling, usage, memProps, image, imageMemory);
 }
 void MImage::clean(VkDevice device) {
     if (imageView != VK_NULL_HANDLE) {
@@ -584,14 +561,21 @@ void MImage::clean(VkDevice device) {
     if (image != VK_NULL_HANDLE) {
         vkDestroyImage(device, image, nullptr);
     }
-    if (imageMemory != VK_NULL_HANDLE) {
-        vkFreeMemory(device, imageMemory, nullptr);
+    if (imageMemory.memory != VK_NULL_HANDLE) {
+        allocator->free(imageMemory);
     }
 }
 void MImage::changeLayout(VkDevice device, VkQueue queue, VkCommandPool pool, VkImageLayout newLayout) {
     transitionImageLayout(queue, device, pool, image, format, lastLayout, newLayout);
     lastLayout = newLayout;
 }
+void MImage::changeLayout(VkCommandBuffer commandBuffer, VkImageLayout newLayout) {
+    recordImageTransition(commandBuffer, image, format, lastLayout, newLayout);
+    lastLayout = newLayout;
+}
+VkFormat MImage::getFormat() {
+    return format;
+}
 void MImage::createImageView(VkDevice device) {
     if (image == VK_NULL_HANDLE) {
         throw std::runtime_error("the image has not been created");
@@ -601,6 +585,12 @@ void MImage::createImageView(VkDevice device) {
 VkImageView MImage::getImageView() {
     return imageView;
 }
+uint32_t MImage::getWidth() {
+    return width;
+}
+uint32_t MImage::getHeight() {
+    return height;
+}
 
 //MSampler
 MSampler::MSampler() {
@@ -686,18 +676,17 @@ void Shader::destroyModule() {
 
 /* Uniform buffer implentation start */
 
-UniformBuffer::UniformBuffer() {};
-UniformBuffer::UniformBuffer(UniverseEngine* en, VkShaderStageFlags flags) {
+UniformBufferBase::UniformBufferBase() {};
+UniformBufferBase::UniformBufferBase(UniverseEngine* en, VkShaderStageFlags flags, VkDeviceSize size) {
     //TODO change
     this->en = en;
     //this->type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
     this->flags = flags;
+    this->size = size;
     //this is done by the UniverseEngine
     //this->id = en->getDescriptors().size();
-    this->uniformBuffers.resize(0);
-    this->uniformBuffersMemory.resize(0);
 }
-VkDescriptorSetLayoutBinding UniformBuffer::getDescriptorSetLayoutBinding() {
+VkDescriptorSetLayoutBinding UniformBufferBase::getDescriptorSetLayoutBinding() {
   std::cout << "get Descriptor set layout\n";
     VkDescriptorSetLayoutBinding layoutBinding {};
     layoutBinding.binding = id;    
@@ -707,25 +696,19 @@ VkDescriptorSetLayoutBinding UniformBuffer::getDescriptorSetLayoutBinding() {
     layoutBinding.stageFlags = flags;
     return layoutBinding;
 }
-void UniformBuffer::preSwapChainCreate(size_t swapChainSize) {
-    //TODO: Possible change
-    VkDeviceSize bufferSize = sizeof(UniformBufferObject);
-
-    std::vector<VkBuffer> b;
-    std::vector<VkDeviceMemory> bm;
-
-    b.resize(swapChainSize);
-    bm.resize(swapChainSize);
-
-    for (size_t i = 0; i < swapChainSize; i++) {
-        createBuffer(en->getDevice(), en->getPhyDevice(), bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, b[i], bm[i]);
-    }
+//The memory is owned by the engine, it creates the arena when the swapchain is created
+void UniformBufferBase::preSwapChainCreate(VkBuffer arena, char *mapped, VkDeviceSize offset, VkDeviceSize stride) {
+    this->arena = arena;
+    this->mapped = mapped;
+    this->offset = offset;
+    this->stride = stride;
 
-    this->uniformBuffers = b;
-    this->uniformBuffersMemory = bm;
+    //The new arena has nothing written yet
+    written.clear();
+    writtenValid.clear();
 }
 //TODO change
-VkWriteDescriptorSet UniformBuffer::getWriterDescriptorSet() {
+VkWriteDescriptorSet UniformBufferBase::getWriterDescriptorSet() {
     VkWriteDescriptorSet set {};
     set.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
     set.dstBinding = id;
@@ -734,29 +717,60 @@ VkWriteDescriptorSet UniformBuffer::getWriterDescriptorSet() {
     set.descriptorCount = 1;
     return set;
 }
-VkBuffer UniformBuffer::getBuffer(uint32_t i) {
-    return this->uniformBuffers[i];
+VkBuffer UniformBufferBase::getBuffer(uint32_t i) {
+    return this->arena;
 }
-VkDeviceSize UniformBuffer::getSize() {
-    return sizeof(UniformBufferObject);
+VkDeviceSize UniformBufferBase::getSize() {
+    return size;
 }
-void UniformBuffer::cleanUp() {
-    for (size_t i = 0; i < uniformBuffers.size(); i++) {
-        vkDestroyBuffer(en->getDevice(), uniformBuffers[i], nullptr);
-        vkFreeMemory(en->getDevice(), uniformBuffersMemory[i], nullptr);
+uint32_t UniformBufferBase::getDynamicOffset(uint32_t index) {
+    return static_cast<uint32_t>(stride * index + offset);
+}
+void UniformBufferBase::cleanUp() {
+    arena = VK_NULL_HANDLE;
+    mapped = nullptr;
+}
+void UniformBufferBase::updateChanged(uint32_t index, const void *data) {
+    if (index >= writtenValid.size()) {
+        written.resize((index + 1) * size);
+        writtenValid.resize(index + 1, false);
+    }
+
+    const char *src = (const char *) data;
+    char *last = written.data() + index * size;
+    if (!writtenValid[index]) {
+        updateRange(index, 0, data, size);
+        return;
     }
+
+    //From the first to the last byte that changed
+    VkDeviceSize begin = 0;
+    while (begin < size && src[begin] == last[begin]) begin++;
+    if (begin == size) return;
+    VkDeviceSize end = size;
+    while (src[end - 1] == last[end - 1]) end--;
+
+    updateRange(index, begin, src + begin, end - begin);
 }
-void UniformBuffer::updateUniformBuffer(uint32_t index, UniformBufferObject obj) {
-    if (uniformBuffers.size() - 1 < index)
-        throw std::runtime_error("The can not update an index that is out of bounds");
-    void *data;
-    vkMapMemory(en->getDevice(), uniformBuffersMemory[index], 0, sizeof(obj), 0, &data);
-    memcpy(data, &obj, sizeof(obj));
-    vkUnmapMemory(en->getDevice(), uniformBuffersMemory[index]);
+void UniformBufferBase::updateRange(uint32_t index, VkDeviceSize offset, const void *data, VkDeviceSize size) {
+    if (mapped == nullptr)
+        throw std::runtime_error("The uniform buffer is not created");
+    if (offset + size > this->size)
+        throw std::runtime_error("The range is outside of the uniform buffer");
+    memcpy(mapped + getDynamicOffset(index) + offset, data, (size_t) size);
+
+    if (index >= writtenValid.size()) {
+        written.resize((index + 1) * this->size);
+        writtenValid.resize(index + 1, false);
+    }
+    memcpy(written.data() + index * this->size + offset, data, (size_t) size);
+    //A partial write on an image that was never written fully still leaves the rest unknown
+    if (offset == 0 && size == this->size)
+        writtenValid[index] = true;
 }
-VkDescriptorType UniformBuffer::getType() { return VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER; }
-void UniformBuffer::setId(size_t id) { this->id=id; }
-size_t UniformBuffer::getId() { return this->id; }
+VkDescriptorType UniformBufferBase::getType() { return VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC; }
+void UniformBufferBase::setId(size_t id) { this->id=id; }
+size_t UniformBufferBase::getId() { return this->id; }
 
 
 
@@ -789,13 +803,14 @@ void ShaderStorageBuffer<T>::preSwapChainCreate(size_t swapChainSize, size_t obj
     bufferSize = sizeof(T) * objssize;
 
     std::vector<VkBuffer> b;
-    std::vector<VkDeviceMemory> bm;
+    std::vector<MemoryAllocation> bm;
 
     b.resize(swapChainSize);
     bm.resize(swapChainSize);
 
+    //The memory stays mapped so that updates are just a copy
     for (size_t i = 0; i < swapChainSize; i++) {
-        createBuffer(en->getDevice(), en->getPhyDevice(), bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, b[i], bm[i]);
+        createBuffer(en->getAllocator(), bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, b[i], bm[i]);
     }
 
     this->ssBuffers = b;
@@ -821,28 +836,38 @@ VkDeviceSize ShaderStorageBuffer<T>::getSize() {
     return this->bufferSize;
 }
 template <typename T>
+size_t ShaderStorageBuffer<T>::getCapacity() {
+    return this->bufferSize / sizeof(T);
+}
+template <typename T>
 void ShaderStorageBuffer<T>::cleanUp() {
     for (size_t i = 0; i < ssBuffers.size(); i++) {
-        vkDestroyBuffer(en->getDevice(), ssBuffers[i], nullptr);
-        vkFreeMemory(en->getDevice(), ssBuffersMemory[i], nullptr);
+        destroyBuffer(en->getAllocator(), ssBuffers[i], ssBuffersMemory[i]);
     }
+    ssBuffers.clear();
+    ssBuffersMemory.clear();
 }
 template <typename T>
-void ShaderStorageBuffer<T>::updateBuffer(uint32_t index, std::vector<T> obj) {
-    if (this->ssBuffers.size() - 1 < index)
-        throw std::runtime_error("The can not update an index that is out of bounds");
-    void *data;
-
-    vkMapMemory(en->getDevice(), ssBuffersMemory[index], 0, sizeof(obj), 0, &data);
-
-    ModelBuffer* b = (ModelBuffer *) data;
-
-    for (size_t i = 0; i < obj.size(); i++) {
-        b[i].model = obj[i];
+void ShaderStorageBuffer<T>::cleanUpLater() {
+    for (size_t i = 0; i < ssBuffers.size(); i++) {
+        en->destroyBufferLater(ssBuffers[i], ssBuffersMemory[i]);
     }
+    ssBuffers.clear();
+    ssBuffersMemory.clear();
+}
+template <typename T>
+void ShaderStorageBuffer<T>::updateBuffer(uint32_t index, const std::vector<T> &obj) {
+    updateBuffer(index, 0, obj.data(), obj.size());
+}
+template <typename T>
+void ShaderStorageBuffer<T>::updateBuffer(uint32_t index, size_t first, const T *obj, size_t count) {
+    if (this->ssBuffers.size() <= index)
+        throw std::runtime_error("The can not update an index that is out of bounds");
+    if (first + count > getCapacity())
+        throw std::runtime_error("The data does not fit in the storage buffer");
 
-    memcpy(data, &b, bufferSize);
-    vkUnmapMemory(en->getDevice(), ssBuffersMemory[index]);
+    T *b = (T *) ssBuffersMemory[index].mapped;
+    memcpy(b + first, obj, sizeof(T) * count);
 }
 template <typename T>
 VkDescriptorType ShaderStorageBuffer<T>::getType() { return VK_DESCRIPTOR_TYPE_STORAGE_BUFFER; }
@@ -860,7 +885,10 @@ size_t ShaderStorageBuffer<T>::getId() { return this->id; }
 
 */
 
-UniverseEngine::UniverseEngine() {};
+//The jobs run on the calling thread until an engine with a window replaces this one
+UniverseEngine::UniverseEngine() {
+    jobs = std::unique_ptr<JobSystem>(new JobSystem());
+};
 UniverseEngine::UniverseEngine(GLFWwindow * window, std::vector<const char *> validationLayers) {
     enableValidationLayers = validationLayers.size() != 0;
     this->validationLayers = validationLayers;
@@ -871,7 +899,12 @@ UniverseEngine::UniverseEngine(GLFWwindow * window, std::vector<const char *> va
     appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     appInfo.pEngineName = "Universe";
     appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    appInfo.apiVersion = VK_API_VERSION_1_0;
+    //Timeline semaphores are core in 1.2 and need 1.1 for the extension, 1.0 loaders do not have vkEnumerateInstanceVersion
+    auto enumerateVersion = (PFN_vkEnumerateInstanceVersion) vkGetInstanceProcAddr(VK_NULL_HANDLE, "vkEnumerateInstanceVersion");
+    uint32_t loaderVersion = VK_API_VERSION_1_0;
+    if (enumerateVersion != nullptr) enumerateVersion(&loaderVersion);
+    apiVersion = loaderVersion >= VK_API_VERSION_1_2 ? VK_API_VERSION_1_2 : (loaderVersion >= VK_API_VERSION_1_1 ? VK_API_VERSION_1_1 : VK_API_VERSION_1_0);
+    appInfo.apiVersion = apiVersion;
 
     VkInstanceCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -901,22 +934,124 @@ UniverseEngine::UniverseEngine(GLFWwindow * window, std::vector<const char *> va
 
     this->window = window;
 
+    jobs = std::unique_ptr<JobSystem>(new JobSystem());
+    jobs->create();
+
     // Set defaults
     surface = VK_NULL_HANDLE;
     phyDevice = VK_NULL_HANDLE;
-    lastId = 0;
 };
 
 /* Game object stuff */
 
-void UniverseEngine::addGameobject(GameObject* o) {
-    o->setId(lastId);
-    lastId += 1;
+ObjectHandle UniverseEngine::addGameobject(GameObject* o) {
+    //Reuse the id of a removed object so that the model buffer does not grow
+    uint32_t id;
+    if (!freeIds.empty()) {
+        id = freeIds.back();
+        freeIds.pop_back();
+    } else {
+        id = static_cast<uint32_t>(objectSlots.size());
+        //The packed vertices only have 16 bits for the id
+        if (PACKED_VERTICES && id > UINT16_MAX) {
+            throw std::runtime_error("too many game objects for packed vertices");
+        }
+        objectSlots.push_back(ObjectSlot {});
+        modelStamps.push_back(0);
+        transforms.resize(objectSlots.size());
+    }
+
+    if (o->isInstanced() && o->getMeshHandle().id >= sharedMeshes.size()) {
+        throw std::runtime_error("the object uses a mesh that was not registered");
+    }
+
+    ObjectSlot &slot = objectSlots[id];
+    slot.obj = o;
+    slot.index = static_cast<uint32_t>(gameObjs.size());
+
+    o->setId(id);
     //Add the verticies to the known verticies
     gameObjs.push_back(o);
+    modelStamps[id] = ++modelStamp;
+    if (o->isInstanced())
+        instancesChanged = true;
 
+    layoutChanged = true;
+    bvhDirty = true;
     recreateModel();
-    createModelData();
+    //Inside a transaction the geometry is built once at commit
+    if (objectTransactions == 0)
+        createModelData();
+
+    ObjectHandle handle {};
+    handle.id = id;
+    handle.generation = slot.generation;
+    return handle;
+}
+
+std::vector<ObjectHandle> UniverseEngine::addGameobjects(const std::vector<GameObject *> &objs) {
+    std::vector<ObjectHandle> handles;
+    handles.reserve(objs.size());
+
+    beginObjects();
+    gameObjs.reserve(gameObjs.size() + objs.size());
+    for (auto o : objs) {
+        handles.push_back(addGameobject(o));
+    }
+    commitObjects();
+
+    return handles;
+}
+
+void UniverseEngine::removeGameobject(ObjectHandle handle) {
+    if (!isAlive(handle))
+        throw std::runtime_error("can not remove an object that was already removed");
+
+    ObjectSlot &slot = objectSlots[handle.id];
+    GameObject *o = slot.obj;
+
+    //Move the last object in to the free position so nothing else has to shift
+    GameObject *last = gameObjs.back();
+    gameObjs[slot.index] = last;
+    objectSlots[last->getId()].index = slot.index;
+    gameObjs.pop_back();
+
+    //When a rebuild is pending it only lays out the objects that are left
+    if (!layoutChanged && handle.id < meshRanges.size())
+        removeGeometry(handle.id);
+
+    if (o->isInstanced())
+        instancesChanged = true;
+    bvhDirty = true;
+
+    slot.obj = nullptr;
+    //Old handles to this id stop working
+    slot.generation++;
+    freeIds.push_back(handle.id);
+
+    o->setId(UINT32_MAX);
+    transforms.clear(handle.id);
+}
+
+GameObject* UniverseEngine::getGameobject(ObjectHandle handle) {
+    if (!isAlive(handle)) return nullptr;
+    return objectSlots[handle.id].obj;
+}
+
+bool UniverseEngine::isAlive(ObjectHandle handle) {
+    return handle.id < objectSlots.size() && objectSlots[handle.id].obj != nullptr && objectSlots[handle.id].generation == handle.generation;
+}
+
+void UniverseEngine::beginObjects() {
+    objectTransactions++;
+}
+
+void UniverseEngine::commitObjects() {
+    if (objectTransactions == 0)
+        throw std::runtime_error("commitObjects called without beginObjects");
+    objectTransactions--;
+    if (objectTransactions == 0 && (layoutChanged || !removedIndexRegions.empty()))
+        createModelData();
 }
 
 /* Vulkan stuff */
@@ -929,23 +1064,34 @@ void UniverseEngine::addDeviceExtencions(char * a) {
 }
 
 void UniverseEngine::cleanup(void) {
+    vkDeviceWaitIdle(device);
+    deletionQueue.flushAll();
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    for (size_t i = 0; i < imageAvailableSemaphores.size(); i++) {
         vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
         vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
-        vkDestroyFence(device, inFlightFences[i], nullptr);
+    }
+    for (auto fence : inFlightFences) {
+        vkDestroyFence(device, fence, nullptr);
+    }
+    if (frameTimeline != VK_NULL_HANDLE) {
+        vkDestroySemaphore(device, frameTimeline, nullptr);
     }
             
-    cleanupPipeline();
+    cleanupPipeline(false);
             
-    vkDestroyBuffer(device, vertexBuffer, nullptr);
-    vkFreeMemory(device, vertexBufferMemory, nullptr);
+    if (vertexBuffer != VK_NULL_HANDLE) {
+        destroyBuffer(&allocator, vertexBuffer, vertexBufferMemory);
+    }
     
-    vkDestroyBuffer(device, indexBuffer, nullptr);
-    vkFreeMemory(device, indexBufferMemory, nullptr);
+    if (indexBuffer != VK_NULL_HANDLE) {
+        destroyBuffer(&allocator, indexBuffer, indexBufferMemory);
+    }
 
     vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
 
+    stagingRing.cleanUp();
+
     vkDestroyCommandPool(device, commandPool, nullptr);
 
     if (surface != VK_NULL_HANDLE)
@@ -955,12 +1101,27 @@ void UniverseEngine::cleanup(void) {
         DestroyDebugUtilsMessengerEXT(instance, debuggerMenssenger, nullptr);
 
 
+    allocator.cleanUp();
+
+    savePipelineCache();
+    vkDestroyPipelineCache(device, pipelineCache, nullptr);
+
     vkDestroyDevice(device, nullptr);
 
+    jobs->cleanUp();
+
     vkDestroyInstance(instance, nullptr);
 }
 
 void UniverseEngine::lockPipelineData() {
+    stagingRing = StagingRing(this, STAGING_RING_SIZE);
+    stagingRing.create();
+
+    modelBuffer = ShaderStorageBuffer<ModelBuffer>(this, VK_SHADER_STAGE_VERTEX_BIT);
+    modelBuffer.setId(unifromBuffers.size());
+    instanceBuffer = ShaderStorageBuffer<uint32_t>(this, VK_SHADER_STAGE_VERTEX_BIT);
+    instanceBuffer.setId(unifromBuffers.size() + 1);
+
     createDescriptorSetLayout();
     createCommandPool();
 }
@@ -1014,16 +1175,60 @@ void UniverseEngine::getDevices() {
         }
     // ----
 
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(phyDevice, &supportedFeatures);
+
     VkPhysicalDeviceFeatures deviceFeatures {};
     deviceFeatures.samplerAnisotropy = VK_TRUE;
+    //Both are optional, the draws fall back to less indirect paths
+    deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+    deviceFeatures.drawIndirectFirstInstance = supportedFeatures.drawIndirectFirstInstance;
+    indirectDraws = supportedFeatures.drawIndirectFirstInstance == VK_TRUE;
+    multiDrawIndirect = indirectDraws && supportedFeatures.multiDrawIndirect == VK_TRUE;
+
+    //Timeline semaphores are core in 1.2, on 1.1 they can come from the extension. Without them the frames use fences
+    std::vector<char *> extensions = deviceExtensions;
+    VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures {};
+    timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+    bool timelineCore = false;
+    timelineSemaphores = false;
+
+    VkPhysicalDeviceProperties deviceProps;
+    vkGetPhysicalDeviceProperties(phyDevice, &deviceProps);
+    maxDrawIndirectCount = std::max(deviceProps.limits.maxDrawIndirectCount, (uint32_t) 1);
+    if (apiVersion >= VK_API_VERSION_1_1 && deviceProps.apiVersion >= VK_API_VERSION_1_1) {
+        timelineCore = apiVersion >= VK_API_VERSION_1_2 && deviceProps.apiVersion >= VK_API_VERSION_1_2;
+
+        bool hasExtension = false;
+        uint32_t extensionsCount = 0;
+        vkEnumerateDeviceExtensionProperties(phyDevice, nullptr, &extensionsCount, nullptr);
+        std::vector<VkExtensionProperties> props(extensionsCount);
+        vkEnumerateDeviceExtensionProperties(phyDevice, nullptr, &extensionsCount, props.data());
+        for (const auto &extension : props) {
+            if (strcmp(extension.extensionName, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) == 0) hasExtension = true;
+        }
+
+        if (timelineCore || hasExtension) {
+            VkPhysicalDeviceFeatures2 features2 {};
+            features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+            features2.pNext = &timelineFeatures;
+            vkGetPhysicalDeviceFeatures2(phyDevice, &features2);
+            timelineSemaphores = timelineFeatures.timelineSemaphore == VK_TRUE;
+        }
+    }
+    timelineFeatures.pNext = nullptr;
+    if (timelineSemaphores && !timelineCore) {
+        extensions.push_back((char *) VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+    }
 
     VkDeviceCreateInfo createInfo {};
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    createInfo.pNext = timelineSemaphores ? &timelineFeatures : nullptr;
     createInfo.pQueueCreateInfos = queueCreateInfos.data();
     createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
     createInfo.pEnabledFeatures = &deviceFeatures;
-    createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+    createInfo.ppEnabledExtensionNames = extensions.data();
 
     //Change create info based if we have the validation layers
     if (validationLayers.size() != 0) {
@@ -1037,15 +1242,82 @@ void UniverseEngine::getDevices() {
         throw std::runtime_error("failed to create logical device");
     }
 
+    if (timelineSemaphores) {
+        waitSemaphores = (PFN_vkWaitSemaphoresKHR) vkGetDeviceProcAddr(device, timelineCore ? "vkWaitSemaphores" : "vkWaitSemaphoresKHR");
+        getSemaphoreCounterValue = (PFN_vkGetSemaphoreCounterValueKHR) vkGetDeviceProcAddr(device, timelineCore ? "vkGetSemaphoreCounterValue" : "vkGetSemaphoreCounterValueKHR");
+        timelineSemaphores = waitSemaphores != nullptr && getSemaphoreCounterValue != nullptr;
+    }
+
     vkGetDeviceQueue(device, queueFamilyIndices.graphicsFamily.value(), 0, &graphicsQueue);
     vkGetDeviceQueue(device, queueFamilyIndices.presentFamily.value(), 0, &presentQueue);
 
+    allocator = MemoryAllocator(phyDevice, device);
+    allocator.create();
+
+    createPipelineCache();
+}
+
+void UniverseEngine::createPipelineCache() {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(phyDevice, &props);
+
+    std::vector<char> data;
+    std::ifstream file(PIPELINE_CACHE_FILE, std::ios::ate | std::ios::binary);
+    if (file.is_open()) {
+        data.resize((size_t) file.tellg());
+        file.seekg(0);
+        file.read(data.data(), data.size());
+        file.close();
+    }
+
+    //The header is the size, the version, the vendor id, the device id and the cache uuid.
+    //A cache from another driver or gpu is not used
+    uint32_t header[4] = {};
+    bool valid = data.size() >= sizeof(header) + VK_UUID_SIZE;
+    if (valid) {
+        memcpy(header, data.data(), sizeof(header));
+        valid = header[0] >= sizeof(header) + VK_UUID_SIZE
+            && header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+            && header[2] == props.vendorID
+            && header[3] == props.deviceID
+            && memcmp(data.data() + sizeof(header), props.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+    }
+    if (!valid) data.clear();
+
+    VkPipelineCacheCreateInfo info {};
+    info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    info.initialDataSize = data.size();
+    info.pInitialData = data.empty() ? nullptr : data.data();
+
+    if (vkCreatePipelineCache(device, &info, nullptr, &pipelineCache) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create the pipeline cache");
+    }
+}
+
+void UniverseEngine::savePipelineCache() {
+    if (pipelineCache == VK_NULL_HANDLE) return;
+
+    size_t size = 0;
+    vkGetPipelineCacheData(device, pipelineCache, &size, nullptr);
+    std::vector<char> data(size);
+    if (size == 0 || vkGetPipelineCacheData(device, pipelineCache, &size, data.data()) != VK_SUCCESS) return;
+
+    //Not being able to write it only makes the next start slower
+    std::ofstream file(PIPELINE_CACHE_FILE, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cerr << "could not write the pipeline cache\n";
+        return;
+    }
+    file.write(data.data(), size);
+    file.close();
 }
 
 void UniverseEngine::createCommandPool() {
     VkCommandPoolCreateInfo info {};
     info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     info.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+    //The draw command buffers are recorded again when the model layout changes
+    info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 
     if (vkCreateCommandPool(device, &info, nullptr, &commandPool) != VK_SUCCESS) {
         throw std::runtime_error("failed to create the command pool");
@@ -1053,8 +1325,23 @@ void UniverseEngine::createCommandPool() {
 }
  
 void UniverseEngine::tick() {
-    for (auto a : gameObjs) {
-        a->tick();
+    //One pass over the arrays instead of going through every object, split between the workers.
+    //The chunks are multiples of 8 so each one writes its own bytes of dirty bits
+    size_t groups = (transforms.size() + 7) / 8;
+    size_t count = transforms.size();
+    jobs->parallelFor(groups, JOB_GRAIN / 8, [this, count](size_t begin, size_t end) {
+        transforms.integrateRange(begin * 8, std::min(end * 8, count));
+    });
+    transforms.collectMoved(movedIds);
+
+    for (auto id : movedIds) {
+        objectMoved(id);
+        if (gpuTransforms || objectSlots[id].obj->isInstanced()) {
+            modelStamps[id] = ++modelStamp;
+        } else {
+            //The mesh is baked with the position so it has to be updated
+            objectSlots[id].obj->transformChanged();
+        }
     }
 }
 
@@ -1068,186 +1355,703 @@ void UniverseEngine::createModelData() {
         throw std::runtime_error("commandPool must be created! run lockPipelineData() to the command pool");
     }
 
-    //TODO: find a better way to do this
-    if (vertexBuffer == VK_NULL_HANDLE || positionChanged) {
-        std::vector<uint32_t> is;
-        std::vector<Vertex> vs;
-        uint32_t p = 0;
-        for (auto g : gameObjs) {
-            Mesh m = g->getMesh();
-            for (auto v : m.v) {
-                vs.push_back(v);
-            }
-            for (auto i : m.i) {
-                is.push_back(i + p);
-            }
-            p += m.v.size();
-        }
-        this->vertecies = vs;
-        this->indicies = is;
-        positionChanged = false;
+    // Objects were added or a mesh changed size so the ranges need to be laid out again
+    if (vertexBuffer == VK_NULL_HANDLE || indexBuffer == VK_NULL_HANDLE || layoutChanged) {
+        rebuildModelData();
+    } else {
+        if (positionChanged)
+            updateModelData();
+        //Before the compaction moves objects in to the holes
+        if (!removedIndexRegions.empty())
+            uploadRemovedIndices();
+        if (!geometryHoles.empty())
+            compactModelData();
     }
+    positionChanged = false;
+}
+
+void UniverseEngine::rebuildModelData() {
+    UploadBatch batch(this);
+
+    bool wasShort = shortIndices;
+    layoutModelData();
+    //Everything is uploaded again
+    removedIndexRegions.clear();
 
     /*
         create vertex buffer
     */
-    VkDeviceSize size = sizeof(vertecies[0]) * vertecies.size();
-
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-
-    //Create the staging buffer
-    createBuffer(device, phyDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-    void* data;
+    VkDeviceSize size = sizeof(GpuVertex) * vertecies.size();
 
-    //Copy data to buffer
-    vkMapMemory(device, stagingBufferMemory, 0, size, 0, &data);
-        memcpy(data, vertecies.data(), (size_t) size);
-    vkUnmapMemory(device, stagingBufferMemory);
-
-    // Check if a buffer exist and if the size is different if so destory it
-    // if the buffer does not exist create buffer on the gpu side
-    if (vertexBuffer != VK_NULL_HANDLE && size != lastVertexBufferSize) {
-        vkDestroyBuffer(device, vertexBuffer, nullptr);
-        vkFreeMemory(device, vertexBufferMemory, nullptr);
-        vertexBuffer = VK_NULL_HANDLE;
+    if (size != 0) {
+        reserveModelBuffer(vertexBuffer, vertexBufferMemory, vertexBufferCapacity, size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+        VkBufferCopy region {0, 0, size};
+        batch.copyRegions(vertexBuffer, vertecies.data(), &region, 1);
     }
-    if (vertexBuffer == VK_NULL_HANDLE)
-        createBuffer(device, phyDevice, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory );
-    lastVertexBufferSize = size;
-
-    copyBuffer(device, commandPool, graphicsQueue, stagingBuffer, vertexBuffer, size);
-
-    //Destory staging buffer
-    vkDestroyBuffer(device, stagingBuffer, nullptr);
-    vkFreeMemory(device, stagingBufferMemory, nullptr);
 
     /*
         create index buffer
     */
-    
-    size = sizeof(indicies[0]) * indicies.size();
-    
-    // create new staging buffer for the index buffer
-    createBuffer(device, phyDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-
-    //Copy data to buffer
-    vkMapMemory(device, stagingBufferMemory, 0, size, 0, &data);
-        memcpy(data, indicies.data(), (size_t) size);
-    vkUnmapMemory(device, stagingBufferMemory);
+    size = (shortIndices ? sizeof(uint16_t) : sizeof(uint32_t)) * indicies.size();
 
-    // Check if a buffer exist and if the size is different if so destory it
-    // if the buffer does not exist create buffer on the gpu side
-    if (indexBuffer != VK_NULL_HANDLE && lastIndexBufferSize != size) {
-        vkDestroyBuffer(device, indexBuffer, nullptr);
-        vkFreeMemory(device, indexBufferMemory, nullptr);
-        indexBuffer = VK_NULL_HANDLE;
+    if (size != 0) {
+        reserveModelBuffer(indexBuffer, indexBufferMemory, indexBufferCapacity, size, VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+        VkBufferCopy region {0, 0, indicies.size()};
+        copyIndexRegions(batch, &region, 1);
     }
-    if (indexBuffer == VK_NULL_HANDLE)
-        createBuffer(device, phyDevice, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory );
-    lastIndexBufferSize = size;
 
-    //Copy data from the staging buffer to the gpu buffer
-    copyBuffer(device, commandPool, graphicsQueue, stagingBuffer, indexBuffer, size);
+    // Vertex and index data go in the same submission
+    batch.submit();
 
-    vkDestroyBuffer(device, stagingBuffer, nullptr);
-    vkFreeMemory(device, stagingBufferMemory, nullptr);
+    layoutChanged = false;
+    // The draws depend on the amount of indicies
+    geometryVersion++;
+    // The index type is in the command buffers
+    if (wasShort != shortIndices)
+        commandVersion++;
 }
 
-// Helper functions ----
-    VkFormat UniverseEngine::findDepthFormat() {
-        return findSupportedFormat(this,
-            {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT},
-            VK_IMAGE_TILING_OPTIMAL,
-            VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT
-        );
+void UniverseEngine::layoutModelData() {
+    meshRanges.assign(objectSlots.size(), MeshRange {});
+    objectsByOffset.clear();
+    geometryHoles.clear();
+
+    shortIndices = std::all_of(gameObjs.begin(), gameObjs.end(), [](GameObject *g) { return g->getVertexCount() <= INDEX_PAGE_SIZE; })
+        && std::all_of(sharedMeshes.begin(), sharedMeshes.end(), [](const SharedMesh &m) { return m.v.size() <= INDEX_PAGE_SIZE; });
+
+    //First pass: the size of every mesh and an exclusive prefix sum of them gives where each one goes
+    uint32_t vertexTotal = 0;
+    uint32_t indexTotal = 0;
+    auto place = [this, &vertexTotal, &indexTotal](MeshRange &r) {
+        //A mesh that would cross in to the next page starts at that page instead
+        if (shortIndices && r.vertexCount != 0 && vertexTotal / INDEX_PAGE_SIZE != (vertexTotal + r.vertexCount - 1) / INDEX_PAGE_SIZE) {
+            vertexTotal = (vertexTotal / INDEX_PAGE_SIZE + 1) * INDEX_PAGE_SIZE;
+        }
+        r.vertexOffset = vertexTotal;
+        r.indexOffset = indexTotal;
+        vertexTotal += r.vertexCount;
+        indexTotal += r.indexCount;
+    };
+
+    for (auto &m : sharedMeshes) {
+        m.range.vertexCount = static_cast<uint32_t>(m.v.size());
+        m.range.indexCount = static_cast<uint32_t>(m.i.size());
+        place(m.range);
     }
-// ----
+    sharedVertexEnd = vertexTotal;
+    sharedIndexEnd = indexTotal;
 
-// Draw stuff ----
-    uint32_t UniverseEngine::getCurrentImage() {
-        vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+    for (size_t o = 0; o < gameObjs.size(); o++) {
+        MeshRange &r = meshRanges[gameObjs[o]->getId()];
+        r.vertexCount = gameObjs[o]->getVertexCount();
+        r.indexCount = gameObjs[o]->getIndexCount();
+        place(r);
+        //The offsets only grow so it stays sorted
+        if (r.vertexCount != 0)
+            objectsByOffset.push_back({r.vertexOffset, gameObjs[o]->getId()});
+    }
 
-        VkResult result = vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+    //Keeps the capacity so a rebuild of the same scene does not reallocate
+    vertecies.resize(vertexTotal);
+    indicies.resize(indexTotal);
 
-        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
-            createPipeline();
-            return 0;
-        } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
-            throw std::runtime_error("failed to acquire swapchain image");
+    //There are only a few shared meshes so they are written here
+    for (auto &m : sharedMeshes) {
+        for (size_t v = 0; v < m.v.size(); v++) {
+            packVertex(m.v[v], vertecies[m.range.vertexOffset + v]);
+        }
+        for (size_t i = 0; i < m.i.size(); i++) {
+            indicies[m.range.indexOffset + i] = m.i[i] + m.range.vertexOffset;
         }
+    }
 
-        if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) {
-            vkWaitForFences(device, 1, &imagesInFlight[imageIndex], VK_TRUE, UINT64_MAX);
+    //Second pass: the workers transform the meshes and write them at their offsets
+    jobs->parallelFor(gameObjs.size(), JOB_GRAIN / 64, [this](size_t begin, size_t end) {
+        for (size_t o = begin; o < end; o++) {
+            GameObject *g = gameObjs[o];
+            MeshRange r = meshRanges[g->getId()];
+            g->transformInto(vertecies.data() + r.vertexOffset, indicies.data() + r.indexOffset, r.vertexOffset);
+            g->clearMeshChanged();
         }
+    });
+}
 
-        imagesInFlight[imageIndex] = inFlightFences[currentFrame];
-        hasCurrentImage = true;
+void UniverseEngine::insertObjectOffset(uint32_t offset, uint32_t id) {
+    auto it = std::lower_bound(objectsByOffset.begin(), objectsByOffset.end(), std::make_pair(offset, (uint32_t) 0));
+    objectsByOffset.insert(it, {offset, id});
+}
 
-        if (positionChanged)
-            createModelData();
+void UniverseEngine::eraseObjectOffset(uint32_t offset) {
+    auto it = std::lower_bound(objectsByOffset.begin(), objectsByOffset.end(), std::make_pair(offset, (uint32_t) 0));
+    if (it != objectsByOffset.end() && it->first == offset)
+        objectsByOffset.erase(it);
+}
 
-        return imageIndex + 1;
-    }
+void UniverseEngine::updateModelData() {
+    std::vector<VkBufferCopy> &regions = changedRegions;
+    regions.clear();
 
-    //Run getCurrentImage 1st
-    void UniverseEngine::draw() {
+    for (size_t o = 0; o < gameObjs.size(); o++) {
+        GameObject *g = gameObjs[o];
+        //Objects out of the view keep the change until they are in it again
+        if (!g->hasMeshChanged() || !isVisible(g->getId())) continue;
 
-        if (!hasCurrentImage) {
-            throw std::runtime_error("getCurrentImage needs to be run 1st");
+        MeshRange r = meshRanges[g->getId()];
+
+        // The object does not fit in its old range anymore
+        if (g->getVertexCount() != r.vertexCount || g->getIndexCount() != r.indexCount) {
+            rebuildModelData();
+            return;
         }
 
-        VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
-        VkPipelineStageFlags waitStates[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-        VkSubmitInfo info {};
-        info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        info.waitSemaphoreCount = 1;
-        info.pWaitSemaphores = waitSemaphores;
-        info.pWaitDstStageMask = waitStates;
-        info.commandBufferCount = 1;
-        info.pCommandBuffers = &commandBuffers[imageIndex];
-        VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
-        info.signalSemaphoreCount = 1;
-        info.pSignalSemaphores = signalSemaphores;
+        g->transformInto(vertecies.data() + r.vertexOffset, nullptr, r.vertexOffset);
 
-        vkResetFences(device, 1, &inFlightFences[currentFrame]);
+        VkBufferCopy region {};
+        region.srcOffset = sizeof(GpuVertex) * r.vertexOffset;
+        region.dstOffset = region.srcOffset;
+        region.size = sizeof(GpuVertex) * r.vertexCount;
 
-        if (vkQueueSubmit(graphicsQueue, 1, &info, inFlightFences[currentFrame]) != VK_SUCCESS) {
-            throw std::runtime_error("failed to submit to draw queue");
+        // Merge with the previous region if they are next to each other
+        if (!regions.empty() && regions.back().srcOffset + regions.back().size == region.srcOffset) {
+            regions.back().size += region.size;
+        } else {
+            regions.push_back(region);
         }
 
-        VkPresentInfoKHR presentInfo {};
-        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-        presentInfo.waitSemaphoreCount = 1;
-        presentInfo.pWaitSemaphores = signalSemaphores;
-        VkSwapchainKHR swapChains[] = {swapchain};
-        presentInfo.swapchainCount = 1;
-        presentInfo.pSwapchains = swapChains;
-        presentInfo.pImageIndices = &imageIndex;
+        g->clearMeshChanged();
+    }
 
-        VkResult result = vkQueuePresentKHR(presentQueue, &presentInfo);
+    // Only the positions changed so the index buffer stays the same
+    if (!regions.empty()) {
+        UploadBatch batch(this);
+        batch.copyRegions(vertexBuffer, vertecies.data(), regions);
+        batch.submit();
+    }
+}
 
-        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized) {
-            framebufferResized = false;
-            createPipeline();
-            return;
-        } else if (result != VK_SUCCESS) {
-            throw std::runtime_error("failed to acquire swapchain image");
+// The range of a removed object is kept as a hole and its indices are made degenerate so it draws nothing
+void UniverseEngine::removeGeometry(uint32_t id) {
+    MeshRange r = meshRanges[id];
+    meshRanges[id] = MeshRange {};
+    if (r.vertexCount == 0) return;
+
+    eraseObjectOffset(r.vertexOffset);
+
+    std::fill(indicies.begin() + r.indexOffset, indicies.begin() + r.indexOffset + r.indexCount, 0);
+
+    //Keep the holes sorted and merge the ones that touch
+    auto it = std::lower_bound(geometryHoles.begin(), geometryHoles.end(), r, [](const MeshRange &a, const MeshRange &b) { return a.vertexOffset < b.vertexOffset; });
+    it = geometryHoles.insert(it, r);
+    auto next = it + 1;
+    if (next != geometryHoles.end() && it->vertexOffset + it->vertexCount == next->vertexOffset && it->indexOffset + it->indexCount == next->indexOffset) {
+        it->vertexCount += next->vertexCount;
+        it->indexCount += next->indexCount;
+        geometryHoles.erase(next);
+    }
+    if (it != geometryHoles.begin()) {
+        auto prev = it - 1;
+        if (prev->vertexOffset + prev->vertexCount == it->vertexOffset && prev->indexOffset + prev->indexCount == it->indexOffset) {
+            prev->vertexCount += it->vertexCount;
+            prev->indexCount += it->indexCount;
+            geometryHoles.erase(it);
         }
-        currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+    }
 
-        hasCurrentImage = false;
+    // The per object draws and the cull items leave out the hole
+    geometryVersion++;
+
+    // The object was at the end so the buffers just get shorter
+    if (trimModelData()) return;
+
+    //Uploaded with the other removals instead of one submission per object
+    if (!removedIndexRegions.empty() && removedIndexRegions.back().srcOffset + removedIndexRegions.back().size == r.indexOffset) {
+        removedIndexRegions.back().size += r.indexCount;
+    } else {
+        removedIndexRegions.push_back({r.indexOffset, r.indexOffset, r.indexCount});
     }
+}
 
-    void UniverseEngine::framBufferResize() {
-        framebufferResized = true;
+void UniverseEngine::uploadRemovedIndices() {
+    //Regions that were trimmed off the end are not in the buffer anymore
+    VkDeviceSize end = indicies.size();
+    for (auto &r : removedIndexRegions) {
+        if (r.srcOffset >= end) {
+            r.size = 0;
+        } else {
+            r.size = std::min(r.size, end - r.srcOffset);
+        }
     }
-//----
+
+    UploadBatch batch(this);
+    copyIndexRegions(batch, removedIndexRegions.data(), removedIndexRegions.size());
+    batch.submit();
+    removedIndexRegions.clear();
+}
+
+// Drops the holes at the end of the buffers, returns true if they got shorter
+bool UniverseEngine::trimModelData() {
+    uint32_t vertexEnd = sharedVertexEnd;
+    uint32_t indexEnd = sharedIndexEnd;
+    if (!objectsByOffset.empty()) {
+        MeshRange &last = meshRanges[objectsByOffset.rbegin()->second];
+        vertexEnd = last.vertexOffset + last.vertexCount;
+        indexEnd = last.indexOffset + last.indexCount;
+    }
+    if (vertexEnd >= vertecies.size()) return false;
+
+    vertecies.resize(vertexEnd);
+    indicies.resize(indexEnd);
+    while (!geometryHoles.empty() && geometryHoles.back().vertexOffset >= vertexEnd) {
+        geometryHoles.pop_back();
+    }
+    // The draws use the amount of indicies
+    geometryVersion++;
+    return true;
+}
+
+// Moves the objects at the end of the buffers in to the holes, a few every frame
+void UniverseEngine::compactModelData() {
+    //Too much is unused, laying everything out again is cheaper than many moves
+    uint32_t unused = 0;
+    for (auto &h : geometryHoles) {
+        unused += h.vertexCount;
+    }
+    if (unused > vertecies.size() / 2) {
+        rebuildModelData();
+        return;
+    }
+
+    std::vector<VkBufferCopy> vertexRegions;
+    std::vector<VkBufferCopy> indexRegions;
+
+    for (uint32_t moves = 0; moves < COMPACTION_MOVES_PER_FRAME && !geometryHoles.empty() && !objectsByOffset.empty(); moves++) {
+        uint32_t id = objectsByOffset.rbegin()->second;
+        MeshRange r = meshRanges[id];
+
+        auto hole = std::find_if(geometryHoles.begin(), geometryHoles.end(), [this, &r](const MeshRange &h) {
+            if (h.vertexCount < r.vertexCount || h.indexCount < r.indexCount) return false;
+            //The object has to stay inside one page
+            return !shortIndices || h.vertexOffset / INDEX_PAGE_SIZE == (h.vertexOffset + r.vertexCount - 1) / INDEX_PAGE_SIZE;
+        });
+        if (hole == geometryHoles.end()) break;
+
+        MeshRange moved {};
+        moved.vertexOffset = hole->vertexOffset;
+        moved.vertexCount = r.vertexCount;
+        moved.indexOffset = hole->indexOffset;
+        moved.indexCount = r.indexCount;
+
+        std::copy(vertecies.begin() + r.vertexOffset, vertecies.begin() + r.vertexOffset + r.vertexCount, vertecies.begin() + moved.vertexOffset);
+        for (uint32_t i = 0; i < r.indexCount; i++) {
+            indicies[moved.indexOffset + i] = indicies[r.indexOffset + i] - r.vertexOffset + moved.vertexOffset;
+        }
+
+        vertexRegions.push_back({sizeof(GpuVertex) * moved.vertexOffset, sizeof(GpuVertex) * moved.vertexOffset, sizeof(GpuVertex) * moved.vertexCount});
+        indexRegions.push_back({moved.indexOffset, moved.indexOffset, moved.indexCount});
+
+        //What is left of the hole keeps its degenerate indices
+        hole->vertexOffset += r.vertexCount;
+        hole->vertexCount -= r.vertexCount;
+        hole->indexOffset += r.indexCount;
+        hole->indexCount -= r.indexCount;
+        if (hole->vertexCount == 0)
+            geometryHoles.erase(hole);
+
+        eraseObjectOffset(r.vertexOffset);
+        insertObjectOffset(moved.vertexOffset, id);
+        meshRanges[id] = moved;
+
+        //The object was the last one so its old range is now at the end
+        trimModelData();
+    }
+
+    if (vertexRegions.empty()) return;
+
+    UploadBatch batch(this);
+    batch.copyRegions(vertexBuffer, vertecies.data(), vertexRegions);
+    copyIndexRegions(batch, indexRegions.data(), indexRegions.size());
+    batch.submit();
+}
+
+// Grows the buffer if needed, the capacity doubles so that adding objects does not allocate every time
+void UniverseEngine::reserveModelBuffer(VkBuffer &buffer, MemoryAllocation &memory, VkDeviceSize &capacity, VkDeviceSize size, VkBufferUsageFlags usage) {
+    if (buffer != VK_NULL_HANDLE && size <= capacity) return;
+
+    if (buffer != VK_NULL_HANDLE) {
+        // The old buffer might still be used by a frame in flight
+        destroyBufferLater(buffer, memory);
+        buffer = VK_NULL_HANDLE;
+        memory = MemoryAllocation {};
+    }
+
+    capacity = std::max(size, capacity * 2);
+    // The command buffers bind the old buffer
+    commandVersion++;
+
+    createBuffer(&allocator, capacity, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, memory);
+}
+
+// The regions are in indices, with short indices only the position inside the page is uploaded
+const void *UniverseEngine::packIndexRegions(const VkBufferCopy *regions, size_t count) {
+    if (!shortIndices) return indicies.data();
+
+    shortIndicies.resize(indicies.size());
+    for (size_t c = 0; c < count; c++) {
+        for (VkDeviceSize i = regions[c].srcOffset; i < regions[c].srcOffset + regions[c].size; i++) {
+            shortIndicies[i] = static_cast<uint16_t>(indicies[i] % INDEX_PAGE_SIZE);
+        }
+    }
+    return shortIndicies.data();
+}
+
+void UniverseEngine::copyIndexRegions(UploadBatch &batch, const VkBufferCopy *regions, size_t count) {
+    VkDeviceSize indexSize = shortIndices ? sizeof(uint16_t) : sizeof(uint32_t);
+    const void *src = packIndexRegions(regions, count);
+
+    //One at a time so the regions in bytes do not need their own vector
+    for (size_t c = 0; c < count; c++) {
+        VkBufferCopy r {regions[c].srcOffset * indexSize, regions[c].dstOffset * indexSize, regions[c].size * indexSize};
+        batch.copyRegions(indexBuffer, src, &r, 1);
+    }
+}
+
+// Groups the objects by page, the indices of a page are next to each other because the vertices and indices are laid out in the same order
+void UniverseEngine::buildDrawBatches() {
+    if (drawBatchesVersion == geometryVersion) return;
+    drawBatchesVersion = geometryVersion;
+    drawBatches.clear();
+    cullItems.clear();
+    bool culling = isCulling();
+
+    if ((culling && gpuTransforms) || cpuCulling) {
+        //Every object gets its own draw so it can be left out, with gpu culling it starts with no instances
+        bool gpuItems = culling && gpuTransforms;
+        for (auto &o : objectsByOffset) {
+            MeshRange &r = meshRanges[o.second];
+            if (r.indexCount == 0 || !isVisible(o.second)) continue;
+
+            int32_t base = shortIndices ? static_cast<int32_t>(r.vertexOffset / INDEX_PAGE_SIZE * INDEX_PAGE_SIZE) : 0;
+            if (gpuItems) {
+                cullItems.push_back(CullItem {objectSlots[o.second].obj->getBounds(), o.second, static_cast<uint32_t>(drawBatches.size()), {0, 0}});
+                drawBatches.push_back(DrawBatch {r.indexOffset, r.indexCount, base, 0, 0});
+                continue;
+            }
+
+            //Visible objects next to each other in the same page are drawn together
+            DrawBatch *b = drawBatches.empty() ? nullptr : &drawBatches.back();
+            if (b != nullptr && b->vertexOffset == base && b->firstIndex + b->indexCount == r.indexOffset) {
+                b->indexCount += r.indexCount;
+            } else {
+                drawBatches.push_back(DrawBatch {r.indexOffset, r.indexCount, base, 0, 1});
+            }
+        }
+    } else if (!shortIndices) {
+        if (!indicies.empty())
+            drawBatches.push_back(DrawBatch {sharedIndexEnd, static_cast<uint32_t>(indicies.size()) - sharedIndexEnd, 0, 0, 1});
+    } else {
+        for (auto &o : objectsByOffset) {
+            MeshRange &r = meshRanges[o.second];
+            if (r.indexCount == 0) continue;
+
+            int32_t base = static_cast<int32_t>(r.vertexOffset / INDEX_PAGE_SIZE * INDEX_PAGE_SIZE);
+            if (drawBatches.empty() || drawBatches.back().vertexOffset != base) {
+                drawBatches.push_back(DrawBatch {r.indexOffset, 0, base, 0, 1});
+            }
+            DrawBatch &b = drawBatches.back();
+            b.indexCount = r.indexOffset + r.indexCount - b.firstIndex;
+        }
+    }
+
+    for (auto &m : sharedMeshes) {
+        if (m.instanceCount == 0 || m.range.indexCount == 0) continue;
+        int32_t base = shortIndices ? static_cast<int32_t>(m.range.vertexOffset / INDEX_PAGE_SIZE * INDEX_PAGE_SIZE) : 0;
+        if (culling) {
+            for (uint32_t k = 0; k < m.instanceCount; k++) {
+                cullItems.push_back(CullItem {m.bounds, instanceIds[m.firstInstance + k], static_cast<uint32_t>(drawBatches.size()), {0, 0}});
+            }
+        }
+        drawBatches.push_back(DrawBatch {m.range.indexOffset, m.range.indexCount, base, m.firstInstance, culling ? 0 : m.instanceCount});
+    }
+}
+
+MeshHandle UniverseEngine::registerMesh(std::vector<Vertex> vertecies, std::vector<uint32_t> indicies) {
+    SharedMesh m {};
+    m.v = vertecies;
+    m.i = indicies;
+    m.bounds = getBoundingSphere(vertecies);
+    sharedMeshes.push_back(m);
+
+    layoutChanged = true;
+    instancesChanged = true;
+
+    MeshHandle handle {};
+    handle.id = static_cast<uint32_t>(sharedMeshes.size() - 1);
+    return handle;
+}
+
+MeshHandle UniverseEngine::getQuadMesh() {
+    if (quadMesh.id == UINT32_MAX) {
+        quadMesh = registerMesh({
+            {{0, 0, 0}, {1, 1, 1}, {-1.0, -1.0}, 1},
+            {{1, 0, 0}, {1, 1, 1}, {-1.0, -1.0}, 1},
+            {{0, 1, 0}, {1, 1, 1}, {-1.0, -1.0}, 1},
+            {{1, 1, 0}, {1, 1, 1}, {-1.0, -1.0}, 1},
+        }, {
+            0, 1, 2,
+            1, 2, 3
+        });
+    }
+    return quadMesh;
+}
+
+// Sorts the ids of the instanced objects by mesh so each mesh draws a range of them
+void UniverseEngine::groupInstances() {
+    for (auto &m : sharedMeshes) {
+        m.instanceCount = 0;
+    }
+    for (auto g : gameObjs) {
+        if (g->isInstanced() && isVisible(g->getId())) sharedMeshes[g->getMeshHandle().id].instanceCount++;
+    }
+
+    uint32_t first = 1;
+    for (auto &m : sharedMeshes) {
+        m.firstInstance = first;
+        first += m.instanceCount;
+        m.instanceCount = 0;
+    }
+
+    instanceIds.assign(first, 0);
+    for (auto g : gameObjs) {
+        if (!g->isInstanced() || !isVisible(g->getId())) continue;
+        SharedMesh &m = sharedMeshes[g->getMeshHandle().id];
+        instanceIds[m.firstInstance + m.instanceCount++] = g->getId();
+    }
+
+    instancesChanged = false;
+    instanceVersion++;
+    // The instance counts are in the draw commands
+    geometryVersion++;
+}
+
+size_t UniverseEngine::instanceBufferCapacity() {
+    size_t capacity = 64;
+    while (capacity < instanceIds.size()) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+void UniverseEngine::updateInstances(uint32_t index) {
+    if (instancesChanged)
+        groupInstances();
+
+    if (instanceBuffer.getCapacity() < instanceIds.size()) {
+        //The buffers and the descriptor sets are used by the frames in flight
+        instanceBuffer.cleanUpLater();
+        instanceBuffer.preSwapChainCreate(swapChainImages.size(), instanceBufferCapacity());
+        instanceImageVersions.assign(swapChainImages.size(), UINT64_MAX);
+        replaceDescriptorSets();
+    }
+
+    if (instanceImageVersions[index] == instanceVersion) return;
+    instanceBuffer.updateBuffer(index, instanceIds);
+    instanceImageVersions[index] = instanceVersion;
+}
+
+void UniverseEngine::uploadImage(MImage *image, const void *pixels, VkDeviceSize size) {
+    UploadBatch batch(this);
+    batch.uploadImage(image, pixels, size);
+    batch.submit();
+}
+
+// Helper functions ----
+    VkFormat UniverseEngine::findDepthFormat() {
+        return findSupportedFormat(this,
+            {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT},
+            VK_IMAGE_TILING_OPTIMAL,
+            VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT
+        );
+    }
+// ----
+
+// Draw stuff ----
+    void UniverseEngine::setFramesInFlight(uint32_t count) {
+        if (count == 0)
+            throw std::runtime_error("there must be at least one frame in flight");
+        if (!imageAvailableSemaphores.empty())
+            throw std::runtime_error("can not change the frames in flight after the sync objects are created");
+        framesInFlight = count;
+    }
+
+    uint64_t UniverseEngine::getSubmittedFrame() {
+        return submittedFrames;
+    }
+
+    uint64_t UniverseEngine::getCompletedFrame() {
+        if (timelineSemaphores) {
+            uint64_t value = 0;
+            if (getSemaphoreCounterValue(device, frameTimeline, &value) != VK_SUCCESS) {
+                throw std::runtime_error("failed to read the frame timeline");
+            }
+            completedFrames = std::max(completedFrames, value);
+        }
+        return completedFrames;
+    }
+
+    void UniverseEngine::waitForFrame(uint64_t frame) {
+        if (frame <= completedFrames) return;
+        if (frame > submittedFrames)
+            throw std::runtime_error("can not wait for a frame that was not submitted");
+
+        if (timelineSemaphores) {
+            VkSemaphoreWaitInfo waitInfo {};
+            waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+            waitInfo.semaphoreCount = 1;
+            waitInfo.pSemaphores = &frameTimeline;
+            waitInfo.pValues = &frame;
+            if (waitSemaphores(device, &waitInfo, UINT64_MAX) != VK_SUCCESS) {
+                throw std::runtime_error("failed to wait for the frame timeline");
+            }
+        } else {
+            //The fence of the frame might have been reused by a later one, the queue finishes them in order so that also works
+            size_t slot = slotFrames.size();
+            for (size_t i = 0; i < slotFrames.size(); i++) {
+                if (slotFrames[i] >= frame && (slot == slotFrames.size() || slotFrames[i] < slotFrames[slot])) slot = i;
+            }
+            vkWaitForFences(device, 1, &inFlightFences[slot], VK_TRUE, UINT64_MAX);
+            frame = slotFrames[slot];
+        }
+        completedFrames = std::max(completedFrames, frame);
+    }
+
+    bool UniverseEngine::usesTimelineSemaphores() {
+        return timelineSemaphores;
+    }
+
+    uint32_t UniverseEngine::getCurrentImage() {
+        //The semaphores of this frame in flight are free again once the frame that last used them is done
+        waitForFrame(slotFrames[currentFrame]);
+
+        VkResult result = vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+            recreateSwapChain();
+            return 0;
+        } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+            throw std::runtime_error("failed to acquire swapchain image");
+        }
+
+        waitForFrame(imageFrames[imageIndex]);
+        hasCurrentImage = true;
+
+        //What was replaced before a finished frame was submitted is not used anymore
+        deletionQueue.flush(getCompletedFrame());
+
+        //Objects being added are picked up when the transaction is committed
+        if (objectTransactions == 0)
+            cullObjects();
+        if (objectTransactions == 0 && (positionChanged || layoutChanged || !geometryHoles.empty()))
+            createModelData();
+
+        updateModelMatrices(imageIndex);
+        updateInstances(imageIndex);
+        updateDrawCommands(imageIndex);
+
+        //The last frame of this image was waited so its command buffer is free to be recorded again.
+        //With push constants it is recorded in draw once they are set
+        if (pushConstantSize == 0 && commandBufferVersions[imageIndex] != commandVersion)
+            recordCommandBuffer(imageIndex);
+
+        return imageIndex + 1;
+    }
+
+    //Run getCurrentImage 1st
+    void UniverseEngine::draw() {
+
+        if (!hasCurrentImage) {
+            throw std::runtime_error("getCurrentImage needs to be run 1st");
+        }
+
+        //Push constants do not carry over from one command buffer to another, so the frame is recorded every time
+        //with them. They are only on with multiDrawIndirect, so this is the render pass, the binds and a few indirect draws
+        if (pushConstantSize != 0)
+            recordCommandBuffer(imageIndex);
+
+        VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
+        VkPipelineStageFlags waitStates[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+        VkSubmitInfo info {};
+        info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        info.waitSemaphoreCount = 1;
+        info.pWaitSemaphores = waitSemaphores;
+        info.pWaitDstStageMask = waitStates;
+        info.commandBufferCount = 1;
+        info.pCommandBuffers = &commandBuffers[imageIndex];
+        VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame], frameTimeline};
+        info.signalSemaphoreCount = 1;
+        info.pSignalSemaphores = signalSemaphores;
+
+        uint64_t frame = submittedFrames + 1;
+        VkFence fence = VK_NULL_HANDLE;
+
+        //The values of the binary semaphores are ignored
+        uint64_t waitValues[] = {0};
+        uint64_t signalValues[] = {0, frame};
+        VkTimelineSemaphoreSubmitInfo timelineInfo {};
+        if (timelineSemaphores) {
+            timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+            timelineInfo.waitSemaphoreValueCount = 1;
+            timelineInfo.pWaitSemaphoreValues = waitValues;
+            timelineInfo.signalSemaphoreValueCount = 2;
+            timelineInfo.pSignalSemaphoreValues = signalValues;
+            info.pNext = &timelineInfo;
+            info.signalSemaphoreCount = 2;
+        } else {
+            fence = inFlightFences[currentFrame];
+            vkResetFences(device, 1, &fence);
+        }
+
+        if (vkQueueSubmit(graphicsQueue, 1, &info, fence) != VK_SUCCESS) {
+            throw std::runtime_error("failed to submit to draw queue");
+        }
+        submittedFrames = frame;
+        slotFrames[currentFrame] = frame;
+        imageFrames[imageIndex] = frame;
+
+        VkPresentInfoKHR presentInfo {};
+        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        presentInfo.waitSemaphoreCount = 1;
+        presentInfo.pWaitSemaphores = signalSemaphores;
+        VkSwapchainKHR swapChains[] = {swapchain};
+        presentInfo.swapchainCount = 1;
+        presentInfo.pSwapchains = swapChains;
+        presentInfo.pImageIndices = &imageIndex;
+
+        VkResult result = vkQueuePresentKHR(presentQueue, &presentInfo);
+
+        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebufferResized) {
+            framebufferResized = false;
+            recreateSwapChain();
+            return;
+        } else if (result != VK_SUCCESS) {
+            throw std::runtime_error("failed to acquire swapchain image");
+        }
+        currentFrame = (currentFrame + 1) % framesInFlight;
+
+        hasCurrentImage = false;
+    }
+
+    void UniverseEngine::framBufferResize() {
+        framebufferResized = true;
+    }
+//----
 
 // Pipeline --------------------
 
 void UniverseEngine::createPipeline() {
+    createPipelineInternal(false);
+}
+
+void UniverseEngine::createPipelineInternal(bool keepSwapChain) {
     if (descriptorSetLayout == VK_NULL_HANDLE) { throw std::runtime_error("The data must be locked first"); }
     
     //If the pipeline is already created check for the screen size
@@ -1264,11 +2068,12 @@ void UniverseEngine::createPipeline() {
     }
 
     //Only cleans if the pipeline was created
-    cleanupPipeline();
+    cleanupPipeline(keepSwapChain);
 
-    createSwapChainInternal();
+    if (!keepSwapChain)
+        createSwapChainInternal();
 
-    imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
+    imageFrames.resize(swapChainImages.size(), 0);
 
     createRenderpass();
 
@@ -1286,62 +2091,155 @@ void UniverseEngine::createPipeline() {
     //     c->preSwapChainCreate(swapChainImages.size());
     // }
     //Pre process uniform buffers
-    for (auto u : unifromBuffers) {
-        u->preSwapChainCreate(swapChainImages.size());
-    }
+    createUniformArena();
+    modelBuffer.preSwapChainCreate(swapChainImages.size(), modelBufferCapacity());
+    modelImageStamps.assign(swapChainImages.size(), 0);
+    instanceBuffer.preSwapChainCreate(swapChainImages.size(), instanceBufferCapacity());
+    instanceImageVersions.assign(swapChainImages.size(), UINT64_MAX);
+    createIndirectBuffers(std::max(indirectCapacity, (uint32_t) 64));
 
     //Depends on the swap chain, descriptors
     createDescriptorPool();
 
     createDescriptorSets();
 
+    if (isCulling())
+        createCullPipeline();
+
     createCommandBuffers();
 
     pipelineCreated = true;
 }
 
-void UniverseEngine::cleanupPipeline() {
+void UniverseEngine::cleanupPipeline(bool keepSwapChain) {
     if (!pipelineCreated) return;
 
     vkDestroyPipeline(device, graphicsPipeline, nullptr);
 
     vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
 
-    depthImage.clean(device);
-
     vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
-    
-    for (auto framebuffer : swapChainFramebuffers) {
-        vkDestroyFramebuffer(device, framebuffer, nullptr);
-    }
+
+    if (!keepSwapChain)
+        cleanupSwapChain(false);
 
     //Clean up descriptors
     // for (auto c : descriptors) {
     //     c->cleanUp();
     // }
         //Clean up unifrom buffers
-        for (auto c : unifromBuffers) {
-            c->cleanUp();
+        cleanupUniformArena();
+        modelBuffer.cleanUp();
+        instanceBuffer.cleanUp();
+        cleanupIndirectBuffers(false);
+        cleanupCullPipeline();
+
+    vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+
+    vkDestroyRenderPass(device, renderPass, nullptr);
+
+    if (keepSwapChain) return;
+    vkDestroySwapchainKHR(device, swapchain, nullptr);
+    swapchain = VK_NULL_HANDLE;
+}
+
+// The swapchain itself is kept so that it can be passed as the old one
+void UniverseEngine::cleanupSwapChain(bool deferred) {
+    if (deferred) {
+        //The frames in flight still render to them
+        MImage depth = depthImage;
+        std::vector<VkFramebuffer> framebuffers = swapChainFramebuffers;
+        std::vector<VkImageView> views = swapChainImageViews;
+        destroyLater([this, depth, framebuffers, views]() mutable {
+            depth.clean(device);
+            for (auto framebuffer : framebuffers) vkDestroyFramebuffer(device, framebuffer, nullptr);
+            for (auto imageView : views) vkDestroyImageView(device, imageView, nullptr);
+        });
+    } else {
+        depthImage.clean(device);
+        for (auto framebuffer : swapChainFramebuffers) {
+            vkDestroyFramebuffer(device, framebuffer, nullptr);
         }
+        for (auto imageView : swapChainImageViews) {
+            vkDestroyImageView(device, imageView, nullptr);
+        }
+    }
+    depthImage = MImage();
+    swapChainFramebuffers.clear();
+    swapChainImageViews.clear();
+}
 
-    size_t descSize = unifromBuffers.size();
+void UniverseEngine::recreateSwapChain() {
+    int width = 0, height = 0;
+    glfwGetFramebufferSize(window, &width, &height);
+    //Minimized, wait until it can be drawn again
+    while (width == 0 || height == 0) {
+        glfwGetFramebufferSize(window, &width, &height);
+        glfwWaitEvents();
+    }
 
-    if (descSize != 0)
-        vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+    size_t imageCount = swapChainImages.size();
+    VkFormat format = swapChainImageFormat;
 
-    vkDestroyRenderPass(device, renderPass, nullptr);
+    //Nothing waits for the gpu, the old objects go to the deletion queue
+    cleanupSwapChain(true);
+    createSwapChainInternal();
 
-    for (auto imageView : swapChainImageViews) {
-        vkDestroyImageView(device, imageView, nullptr);
+    //The render pass and everything per image still match, this is almost always the case
+    if (swapChainImages.size() != imageCount || swapChainImageFormat != format) {
+        //Everything else is rebuilt around the swapchain that was just made
+        createPipelineInternal(true);
+        return;
     }
 
-    vkDestroySwapchainKHR(device, swapchain, nullptr);
+    createDepthResourses();
+    createFramebuffers();
+
+    //The framebuffers and the size are in the command buffers
+    commandVersion++;
+}
+
+// One buffer for every uniform buffer and swapchain image, each piece starts at minUniformBufferOffsetAlignment
+void UniverseEngine::createUniformArena() {
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(phyDevice, &props);
+    VkDeviceSize alignment = std::max((VkDeviceSize) 1, props.limits.minUniformBufferOffsetAlignment);
+
+    std::vector<VkDeviceSize> offsets;
+    VkDeviceSize stride = 0;
+    for (auto u : unifromBuffers) {
+        offsets.push_back(stride);
+        stride += (u->getSize() + alignment - 1) / alignment * alignment;
+    }
+    if (stride == 0) return;
+
+    //They are all freed together when the swapchain is recreated
+    createBuffer(&allocator, stride * swapChainImages.size(), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformArena, uniformArenaMemory, MEMORY_STRATEGY_LINEAR);
+
+    for (size_t b = 0; b < unifromBuffers.size(); b++) {
+        unifromBuffers[b]->preSwapChainCreate(uniformArena, (char *) uniformArenaMemory.mapped, offsets[b], stride);
+    }
+
+    uniformDynamicOffsets.assign(swapChainImages.size(), {});
+    for (uint32_t i = 0; i < swapChainImages.size(); i++) {
+        for (auto u : unifromBuffers) {
+            uniformDynamicOffsets[i].push_back(u->getDynamicOffset(i));
+        }
+    }
+}
+
+void UniverseEngine::cleanupUniformArena() {
+    for (auto u : unifromBuffers) {
+        u->cleanUp();
+    }
+    if (uniformArena != VK_NULL_HANDLE)
+        destroyBuffer(&allocator, uniformArena, uniformArenaMemory);
+    uniformArena = VK_NULL_HANDLE;
+    uniformDynamicOffsets.clear();
 }
 
 //Needs to be recreated each time because it depends on the swapchain
 void UniverseEngine::createDescriptorPool() {
-    size_t descSize = unifromBuffers.size();
-    if (descSize == 0) return;
     std::vector<VkDescriptorPoolSize> pools;
     uint32_t count = static_cast<uint32_t>(swapChainImages.size());
 
@@ -1360,6 +2258,18 @@ void UniverseEngine::createDescriptorPool() {
             pools.push_back(p);
         }
 
+    // Model buffer
+        VkDescriptorPoolSize mp {};
+        mp.type = modelBuffer.getType();
+        mp.descriptorCount = count;
+        pools.push_back(mp);
+
+    // Instance buffer
+        VkDescriptorPoolSize ip {};
+        ip.type = instanceBuffer.getType();
+        ip.descriptorCount = count;
+        pools.push_back(ip);
+
     VkDescriptorPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     poolInfo.poolSizeCount = static_cast<uint32_t>(pools.size());
@@ -1407,13 +2317,19 @@ void UniverseEngine::createSwapChainInternal() {
         createInfo.pQueueFamilyIndices = nullptr;
     }
 
-    createInfo.oldSwapchain = VK_NULL_HANDLE;
+    //The driver can reuse the images of the old one, it is destroyed once the new one exists
+    VkSwapchainKHR oldSwapchain = swapchain;
+    createInfo.oldSwapchain = oldSwapchain;
 
     //Try to create the swapchain
     if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapchain) != VK_SUCCESS) {
         throw std::runtime_error("could not create swapchain");
     }
 
+    //Frames in flight might still present from it
+    if (oldSwapchain != VK_NULL_HANDLE)
+        destroyLater([this, oldSwapchain]() { vkDestroySwapchainKHR(device, oldSwapchain, nullptr); });
+
     //Get the swapchain images
     vkGetSwapchainImagesKHR(device, swapchain, &imageCount, nullptr);
     swapChainImages.resize(imageCount);
@@ -1505,13 +2421,13 @@ void UniverseEngine::createRenderpass() {
 //    descriptors.push_back(desc);
 //}
 
-void UniverseEngine::addUniformBuffer(UniformBuffer * desc) {
+void UniverseEngine::addUniformBuffer(UniformBufferBase * desc) {
     if (descriptorSetLayout != VK_NULL_HANDLE) {
         throw std::runtime_error("The descriptor set layout is already created");
     }
     std::cout << "Added Descriptor\n";
-    size_t descSize = getDescriptorsSize();
-    desc->setId(descSize);
+    //The model buffer is bound after all the uniform buffers
+    desc->setId(unifromBuffers.size());
     unifromBuffers.push_back(desc);
 }
 
@@ -1535,18 +2451,25 @@ void UniverseEngine::addShader(Shader* shader) {
     shaders.push_back(shader);
 }
 
+//Turns on specialization constant 0 of the shaders, which makes them read the push constants
+static const VkBool32 pushConstantsOn = VK_TRUE;
+static const VkSpecializationMapEntry pushConstantsEntry {0, 0, sizeof(VkBool32)};
+static const VkSpecializationInfo pushConstantsInfo {1, &pushConstantsEntry, sizeof(VkBool32), &pushConstantsOn};
+
 void UniverseEngine::createGraphicsPipeline() {
 
     std::vector<VkPipelineShaderStageCreateInfo> shaderStates;
 
     for (Shader* shader : shaders) {
         shaderStates.push_back(shader->getPipelineCreateInfo());
+        if (pushConstantSize != 0)
+            shaderStates.back().pSpecializationInfo = &pushConstantsInfo;
     }
 
     //Got shaders
 
-    auto bindingDescription = Vertex::getBindingDescription();
-    auto attributeDescriptions = Vertex::getAttributeDescription();
+    auto bindingDescription = GpuVertexFormat::getBindingDescription();
+    auto attributeDescriptions = GpuVertexFormat::getAttributeDescription();
 
     VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
 
@@ -1561,24 +2484,19 @@ void UniverseEngine::createGraphicsPipeline() {
     inputAssemblyCreateInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
     inputAssemblyCreateInfo.primitiveRestartEnable = VK_FALSE;
     
-    VkViewport viewport {};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = (float) swapChainExtent.width;
-    viewport.height = (float) swapChainExtent.height;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 0.0f;
-
-    VkRect2D scissor {};
-    scissor.offset = {0,0};
-    scissor.extent = swapChainExtent;
-
+    //Set in the command buffers so the pipeline does not depend on the size of the window
     VkPipelineViewportStateCreateInfo viewportState{};
     viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
     viewportState.viewportCount = 1;
-    viewportState.pViewports = &viewport;
+    viewportState.pViewports = nullptr;
     viewportState.scissorCount = 1;
-    viewportState.pScissors = &scissor;
+    viewportState.pScissors = nullptr;
+
+    std::array<VkDynamicState, 2> dynamicStates = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+    VkPipelineDynamicStateCreateInfo dynamicState {};
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+    dynamicState.pDynamicStates = dynamicStates.data();
 
     VkPipelineRasterizationStateCreateInfo rasterizer{};
     rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
@@ -1638,6 +2556,10 @@ void UniverseEngine::createGraphicsPipeline() {
     pipelineLayoutInfo.setLayoutCount = 1;
     pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
 
+    VkPushConstantRange pushRange = pushConstantRange();
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushRange;
+
     if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
         throw std::runtime_error("Could not create pipeline layout");
     }
@@ -1654,14 +2576,14 @@ void UniverseEngine::createGraphicsPipeline() {
     pipelineInfo.pMultisampleState = &multisampling;
     pipelineInfo.pDepthStencilState = &depthStencil;
     pipelineInfo.pColorBlendState = &colorBlending;
-    pipelineInfo.pDynamicState = nullptr;
+    pipelineInfo.pDynamicState = &dynamicState;
 
     pipelineInfo.layout = pipelineLayout;
 
     pipelineInfo.renderPass = renderPass;
     pipelineInfo.subpass = 0;
 
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS) {
+    if (vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS) {
         throw std::runtime_error("no pipeline created");
     }
 
@@ -1696,6 +2618,12 @@ void UniverseEngine::createDescriptorSetLayout() {
             lbs.push_back(a->getDescriptorSetLayoutBinding());
         }
 
+    //Model matrices
+        lbs.push_back(modelBuffer.getDescriptorSetLayoutBinding());
+
+    //Objects of the instances
+        lbs.push_back(instanceBuffer.getDescriptorSetLayoutBinding());
+
     VkDescriptorSetLayoutCreateInfo info {};
     info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
     info.bindingCount = static_cast<uint32_t>(lbs.size());
@@ -1707,8 +2635,6 @@ void UniverseEngine::createDescriptorSetLayout() {
 }
 //Descriptors must be set before this is run
 void UniverseEngine::createDescriptorSets() {
-    if (getDescriptorsSize() == 0) return;
-
     uint32_t size = static_cast<uint32_t>(swapChainImages.size());
 
     std::vector<VkDescriptorSetLayout> layouts(size, descriptorSetLayout);
@@ -1725,7 +2651,11 @@ void UniverseEngine::createDescriptorSets() {
         throw std::runtime_error("faield to allocate descriptor sets");
     }
 
-    for (size_t i = 0; i < size; i++) {
+    writeDescriptorSets();
+}
+
+void UniverseEngine::writeDescriptorSets() {
+    for (size_t i = 0; i < descriptorSets.size(); i++) {
         /* TODO: do in the class
         VkDescriptorImageInfo imageInfo {};
         imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
@@ -1735,6 +2665,8 @@ void UniverseEngine::createDescriptorSets() {
 
         std::vector<VkWriteDescriptorSet> sets;
         sets.resize(getDescriptorsSize());
+        //Needs to stay alive until vkUpdateDescriptorSets
+        std::vector<VkDescriptorBufferInfo> bufInfos(getDescriptorsSize());
 
         /*
         for (uint32_t bi = 0; bi < getDescriptorsSize(); bi++) {
@@ -1744,10 +2676,10 @@ void UniverseEngine::createDescriptorSets() {
         }
         */
 
-        for (UniformBuffer * u : unifromBuffers) {
+        for (UniformBufferBase * u : unifromBuffers) {
             VkWriteDescriptorSet setu = u->getWriterDescriptorSet();
             setu.dstSet = descriptorSets[i];
-            VkDescriptorBufferInfo bufInfou {};
+            VkDescriptorBufferInfo &bufInfou = bufInfos[u->getId()];
             bufInfou.buffer = u->getBuffer(i);
             bufInfou.offset = 0;
             bufInfou.range = u->getSize();
@@ -1755,6 +2687,24 @@ void UniverseEngine::createDescriptorSets() {
             sets[u->getId()] = setu;
         }
 
+        VkWriteDescriptorSet setm = modelBuffer.getWriterDescriptorSet();
+        setm.dstSet = descriptorSets[i];
+        VkDescriptorBufferInfo &bufInfom = bufInfos[modelBuffer.getId()];
+        bufInfom.buffer = modelBuffer.getBuffer(i);
+        bufInfom.offset = 0;
+        bufInfom.range = modelBuffer.getSize();
+        setm.pBufferInfo = &bufInfom;
+        sets[modelBuffer.getId()] = setm;
+
+        VkWriteDescriptorSet seti = instanceBuffer.getWriterDescriptorSet();
+        seti.dstSet = descriptorSets[i];
+        VkDescriptorBufferInfo &bufInfoi = bufInfos[instanceBuffer.getId()];
+        bufInfoi.buffer = instanceBuffer.getBuffer(i);
+        bufInfoi.offset = 0;
+        bufInfoi.range = instanceBuffer.getSize();
+        seti.pBufferInfo = &bufInfoi;
+        sets[instanceBuffer.getId()] = seti;
+
 /*      TODO: class
         descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
         descriptorWrites[1].dstSet = descriptorSets[i];
@@ -1766,11 +2716,14 @@ void UniverseEngine::createDescriptorSets() {
 
         vkUpdateDescriptorSets(device, static_cast<uint32_t>(sets.size()), sets.data(), 0, nullptr);
     }
+
+    //They point at the same model and instance buffers
+    writeCullDescriptorSets();
 }
 
 void UniverseEngine::createDepthResourses() {
     depthImage = MImage(swapChainExtent.width, swapChainExtent.height, findDepthFormat(), VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_ASPECT_DEPTH_BIT);
-    depthImage.create(device, phyDevice);
+    depthImage.create(&allocator);
     depthImage.createImageView(device);
 }
 
@@ -1816,57 +2769,107 @@ void UniverseEngine::createCommandBuffers() {
         throw std::runtime_error("failed to created buffers");
     }
 
+    commandBufferVersions.resize(commandBuffers.size());
+
     for (size_t i = 0; i < commandBuffers.size(); i++) {
-        VkCommandBufferBeginInfo beginInfo {};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        recordCommandBuffer(i);
+    }
+}
 
-        if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) != VK_SUCCESS) {
-            throw std::runtime_error("failed to begin recording command buffer");
-        }
+void UniverseEngine::recordCommandBuffer(size_t i) {
+    VkCommandBufferBeginInfo beginInfo {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    //Recorded again before the next frame of the image
+    if (pushConstantSize != 0)
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-        std::array<VkClearValue, 2> clearValues{};
-        //TODO: possible change
-        clearValues[0].color = {{0.0f, 0.0f, 0.0f, 1.0f}};
-        clearValues[1].depthStencil = {1.0f, 0};
+    if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording command buffer");
+    }
 
-        //TODO: Possible change to add mutiple passes
-        VkRenderPassBeginInfo renderPassInfo {};
-        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        renderPassInfo.renderPass = renderPass;
-        renderPassInfo.framebuffer = swapChainFramebuffers[i];
-        renderPassInfo.renderArea.offset = {0, 0};
-        renderPassInfo.renderArea.extent = swapChainExtent;
-        renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
-        renderPassInfo.pClearValues = clearValues.data();
+    std::array<VkClearValue, 2> clearValues{};
+    //TODO: possible change
+    clearValues[0].color = {{0.0f, 0.0f, 0.0f, 1.0f}};
+    clearValues[1].depthStencil = {1.0f, 0};
 
-        vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    //TODO: Possible change to add mutiple passes
+    VkRenderPassBeginInfo renderPassInfo {};
+    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    renderPassInfo.renderPass = renderPass;
+    renderPassInfo.framebuffer = swapChainFramebuffers[i];
+    renderPassInfo.renderArea.offset = {0, 0};
+    renderPassInfo.renderArea.extent = swapChainExtent;
+    renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+    renderPassInfo.pClearValues = clearValues.data();
 
-        vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-        
-        VkBuffer vertexBuffers[] = {vertexBuffer};
-        VkDeviceSize offsets[] = {0};
+    //Compute work has to be outside of the render pass
+    if (isCulling())
+        recordCullPass(i);
 
-        vkCmdBindVertexBuffers(commandBuffers[i], 0, 1, vertexBuffers, offsets);
+    vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-        vkCmdBindIndexBuffer(commandBuffers[i], indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+    vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
 
-        if (getDescriptorsSize() != 0)
-            vkCmdBindDescriptorSets(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[i], 0, nullptr);
+    VkViewport viewport {};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = (float) swapChainExtent.width;
+    viewport.height = (float) swapChainExtent.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 0.0f;
+    vkCmdSetViewport(commandBuffers[i], 0, 1, &viewport);
 
-        vkCmdDrawIndexed(commandBuffers[i], static_cast<uint32_t>(indicies.size()), 1, 0 , 0, 0);
+    VkRect2D scissor {};
+    scissor.offset = {0,0};
+    scissor.extent = swapChainExtent;
+    vkCmdSetScissor(commandBuffers[i], 0, 1, &scissor);
+    
+    VkBuffer vertexBuffers[] = {vertexBuffer};
+    VkDeviceSize offsets[] = {0};
 
-        vkCmdEndRenderPass(commandBuffers[i]);
+    //Bound even when there is nothing to draw yet, the indirect draws can start using them without recording again
+    if (vertexBuffer != VK_NULL_HANDLE && indexBuffer != VK_NULL_HANDLE) {
+        vkCmdBindVertexBuffers(commandBuffers[i], 0, 1, vertexBuffers, offsets);
+
+        vkCmdBindIndexBuffer(commandBuffers[i], indexBuffer, 0, shortIndices ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32);
+    }
 
-        if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-            throw std::runtime_error("failed to record command buffer");
+    std::vector<uint32_t> &dynamicOffsets = uniformDynamicOffsets[i];
+    vkCmdBindDescriptorSets(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[i], static_cast<uint32_t>(dynamicOffsets.size()), dynamicOffsets.data());
+    if (pushConstantSize != 0)
+        vkCmdPushConstants(commandBuffers[i], pipelineLayout, pushConstantStages(), 0, pushConstantSize, pushConstantData.data());
+
+    buildDrawBatches();
+    if (vertexBuffer == VK_NULL_HANDLE || indexBuffer == VK_NULL_HANDLE) {
+        //Nothing to draw
+    } else if (multiDrawIndirect) {
+        for (uint32_t first = 0; first < indirectCapacity; first += maxDrawIndirectCount) {
+            uint32_t count = std::min(maxDrawIndirectCount, indirectCapacity - first);
+            vkCmdDrawIndexedIndirect(commandBuffers[i], indirectBuffers[i], first * sizeof(VkDrawIndexedIndirectCommand), count, sizeof(VkDrawIndexedIndirectCommand));
+        }
+    } else if (indirectDraws) {
+        for (size_t d = 0; d < drawBatches.size(); d++) {
+            vkCmdDrawIndexedIndirect(commandBuffers[i], indirectBuffers[i], d * sizeof(VkDrawIndexedIndirectCommand), 1, sizeof(VkDrawIndexedIndirectCommand));
+        }
+    } else {
+        for (auto &b : drawBatches) {
+            vkCmdDrawIndexed(commandBuffers[i], b.indexCount, b.instanceCount, b.firstIndex, b.vertexOffset, b.firstInstance);
         }
     }
+
+    vkCmdEndRenderPass(commandBuffers[i]);
+
+    if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record command buffer");
+    }
+
+    commandBufferVersions[i] = commandVersion;
 }
 
 void UniverseEngine::createSyncObjects() {
-    renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+    renderFinishedSemaphores.resize(framesInFlight);
+    imageAvailableSemaphores.resize(framesInFlight);
+    slotFrames.resize(framesInFlight, 0);
 
     VkSemaphoreCreateInfo createSemaphoreInfo{};
     createSemaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -1875,17 +2878,511 @@ void UniverseEngine::createSyncObjects() {
     createFenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
     createFenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    for (size_t i = 0; i < framesInFlight; i++) {
         if( vkCreateSemaphore(device, &createSemaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
-            vkCreateSemaphore(device, &createSemaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS || 
-            vkCreateFence(device, &createFenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) {
+            vkCreateSemaphore(device, &createSemaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS) {
             throw std::runtime_error("failed to create semaphore");
         }
     }
+
+    //One semaphore counts the finished frames, otherwise each frame in flight has a fence
+    if (timelineSemaphores) {
+        VkSemaphoreTypeCreateInfo typeInfo {};
+        typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        typeInfo.initialValue = 0;
+
+        VkSemaphoreCreateInfo timelineInfo {};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        timelineInfo.pNext = &typeInfo;
+        if (vkCreateSemaphore(device, &timelineInfo, nullptr, &frameTimeline) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create the frame timeline");
+        }
+        return;
+    }
+
+    inFlightFences.resize(framesInFlight);
+    for (size_t i = 0; i < framesInFlight; i++) {
+        if (vkCreateFence(device, &createFenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create fence");
+        }
+    }
 }
 
 void UniverseEngine::recreateModel() { positionChanged = true; }
 
+void UniverseEngine::setGpuTransforms(bool enabled) {
+    if (gpuTransforms == enabled) return;
+    gpuTransforms = enabled;
+
+    //The vertices need to be uploaded again in the other space and every matrix rewritten
+    layoutChanged = true;
+    for (auto &s : modelStamps) {
+        s = ++modelStamp;
+    }
+}
+
+void UniverseEngine::destroyLater(std::function<void()> destroy) {
+    deletionQueue.push(submittedFrames, std::move(destroy));
+}
+
+void UniverseEngine::destroyBufferLater(VkBuffer buffer, MemoryAllocation memory) {
+    destroyLater([this, buffer, memory]() mutable { destroyBuffer(&allocator, buffer, memory); });
+}
+
+void UniverseEngine::replaceDescriptorSets() {
+    //The cull sets go first, writing the main sets also writes them
+    if (cullPipeline != VK_NULL_HANDLE) {
+        VkDescriptorPool oldCullPool = cullDescriptorPool;
+        destroyLater([this, oldCullPool]() { vkDestroyDescriptorPool(device, oldCullPool, nullptr); });
+        createCullDescriptorSets();
+    }
+
+    VkDescriptorPool oldPool = descriptorPool;
+    destroyLater([this, oldPool]() { vkDestroyDescriptorPool(device, oldPool, nullptr); });
+    createDescriptorPool();
+    createDescriptorSets();
+
+    //The command buffers bind the old sets
+    commandVersion++;
+}
+
+void UniverseEngine::updateModelMatrix(uint32_t id) {
+    //The object is not added yet
+    if (id >= modelStamps.size()) return;
+    modelStamps[id] = ++modelStamp;
+}
+
+size_t UniverseEngine::modelBufferCapacity() {
+    size_t capacity = 64;
+    while (capacity < objectSlots.size()) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+void UniverseEngine::createIndirectBuffers(uint32_t capacity) {
+    indirectCapacity = capacity;
+    indirectBuffers.resize(swapChainImages.size());
+    indirectBuffersMemory.resize(swapChainImages.size());
+    indirectImageVersions.assign(swapChainImages.size(), UINT64_MAX);
+
+    if (!indirectDraws) return;
+    for (size_t i = 0; i < swapChainImages.size(); i++) {
+        //The cull pass writes the instance counts
+        createBuffer(&allocator, sizeof(VkDrawIndexedIndirectCommand) * capacity, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, indirectBuffers[i], indirectBuffersMemory[i]);
+    }
+
+    if (!isCulling()) return;
+    drawTemplateBuffers.resize(swapChainImages.size());
+    drawTemplateBuffersMemory.resize(swapChainImages.size());
+    for (size_t i = 0; i < swapChainImages.size(); i++) {
+        createBuffer(&allocator, sizeof(VkDrawIndexedIndirectCommand) * capacity, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, drawTemplateBuffers[i], drawTemplateBuffersMemory[i]);
+    }
+}
+
+void UniverseEngine::cleanupIndirectBuffers(bool deferred) {
+    for (size_t i = 0; i < indirectBuffers.size(); i++) {
+        if (indirectBuffers[i] == VK_NULL_HANDLE) continue;
+        if (deferred) {
+            destroyBufferLater(indirectBuffers[i], indirectBuffersMemory[i]);
+        } else {
+            destroyBuffer(&allocator, indirectBuffers[i], indirectBuffersMemory[i]);
+        }
+    }
+    indirectBuffers.clear();
+    indirectBuffersMemory.clear();
+
+    for (size_t i = 0; i < drawTemplateBuffers.size(); i++) {
+        if (deferred) {
+            destroyBufferLater(drawTemplateBuffers[i], drawTemplateBuffersMemory[i]);
+        } else {
+            destroyBuffer(&allocator, drawTemplateBuffers[i], drawTemplateBuffersMemory[i]);
+        }
+    }
+    drawTemplateBuffers.clear();
+    drawTemplateBuffersMemory.clear();
+}
+
+//Writes the draw list of this image if it changed since the image was last used
+void UniverseEngine::updateDrawCommands(uint32_t index) {
+    size_t previous = drawBatches.size();
+    bool changed = drawBatchesVersion != geometryVersion;
+    buildDrawBatches();
+
+    //The direct draws are in the command buffer, and so is the number of draws when there is no multi draw
+    if (changed && (!indirectDraws || (!multiDrawIndirect && drawBatches.size() != previous)))
+        commandVersion++;
+    if (!indirectDraws) return;
+
+    if (drawBatches.size() > indirectCapacity) {
+        //The buffers are used by the frames in flight
+        cleanupIndirectBuffers(true);
+        uint32_t capacity = indirectCapacity;
+        while (capacity < drawBatches.size()) {
+            capacity *= 2;
+        }
+        createIndirectBuffers(capacity);
+        replaceDescriptorSets();
+    }
+
+    if (isCulling() && cullItems.size() > cullItemCapacity) {
+        cleanupCullItemBuffers(true);
+        uint32_t capacity = cullItemCapacity;
+        while (capacity < cullItems.size()) {
+            capacity *= 2;
+        }
+        createCullItemBuffers(capacity);
+        //The dispatch covers the whole buffer
+        replaceDescriptorSets();
+    }
+
+    if (indirectImageVersions[index] == geometryVersion) return;
+
+    if (isCulling()) {
+        uint32_t *count = (uint32_t *) cullItemBuffersMemory[index].mapped;
+        *count = static_cast<uint32_t>(cullItems.size());
+        memcpy((char *) count + sizeof(CullItem::sphere), cullItems.data(), sizeof(CullItem) * cullItems.size());
+    }
+
+    //With culling the indirect buffer is written by the copy at the start of the frame
+    MemoryAllocation &target = isCulling() ? drawTemplateBuffersMemory[index] : indirectBuffersMemory[index];
+    VkDrawIndexedIndirectCommand *commands = (VkDrawIndexedIndirectCommand *) target.mapped;
+    for (size_t d = 0; d < drawBatches.size(); d++) {
+        DrawBatch &b = drawBatches[d];
+        commands[d].indexCount = b.indexCount;
+        commands[d].instanceCount = b.instanceCount;
+        commands[d].firstIndex = b.firstIndex;
+        commands[d].vertexOffset = b.vertexOffset;
+        commands[d].firstInstance = b.firstInstance;
+    }
+    //The multi draw goes through the whole buffer
+    memset(commands + drawBatches.size(), 0, sizeof(VkDrawIndexedIndirectCommand) * (indirectCapacity - drawBatches.size()));
+
+    indirectImageVersions[index] = geometryVersion;
+}
+
+void UniverseEngine::enableCulling(Shader *shader) {
+    if (pipelineCreated)
+        throw std::runtime_error("culling must be enabled before the pipeline is created");
+    cullShader = shader;
+}
+
+bool UniverseEngine::isCulling() {
+    return cullShader != nullptr && indirectDraws;
+}
+
+void UniverseEngine::setCpuCulling(bool enabled) {
+    if (cpuCulling == enabled) return;
+    cpuCulling = enabled;
+    bvhDirty = true;
+
+    //Everything is visible again until the next cull
+    if (!enabled) {
+        visibleIds.clear();
+        visibleObjects.clear();
+        geometryVersion++;
+        instancesChanged = true;
+        recreateModel();
+    }
+}
+
+void UniverseEngine::enablePushConstants(uint32_t size) {
+    if (pipelineCreated)
+        throw std::runtime_error("the push constants must be enabled before the pipeline is created");
+    if (size == 0)
+        throw std::runtime_error("the push constants can not be empty");
+
+    //The frame is recorded again every time with push constants, that is only a few commands when all the draws are one multi draw.
+    //Otherwise the uniform buffer is cheaper
+    if (!multiDrawIndirect) return;
+
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(phyDevice, &props);
+    if (size > props.limits.maxPushConstantsSize) return;
+
+    pushConstantSize = size;
+    pushConstantData.assign(size, 0);
+}
+
+bool UniverseEngine::usesPushConstants() {
+    return pushConstantSize != 0;
+}
+
+void UniverseEngine::setPushConstants(const void *data, uint32_t size) {
+    if (size != pushConstantSize)
+        throw std::runtime_error("the push constants do not have the enabled size");
+    memcpy(pushConstantData.data(), data, size);
+}
+
+VkShaderStageFlags UniverseEngine::pushConstantStages() {
+    return VK_SHADER_STAGE_VERTEX_BIT | (isCulling() ? VK_SHADER_STAGE_COMPUTE_BIT : 0);
+}
+
+//The shaders always declare the camera block, so the layouts need the range even when nothing is pushed.
+//A mat4 is below the 128 bytes every device has
+VkPushConstantRange UniverseEngine::pushConstantRange() {
+    return VkPushConstantRange {pushConstantStages(), 0, std::max(pushConstantSize, (uint32_t) sizeof(glm::mat4))};
+}
+
+void UniverseEngine::setViewProjection(glm::mat4 viewProj) {
+    if (this->viewProj == viewProj) return;
+    this->viewProj = viewProj;
+    visibilityChanged = true;
+}
+
+void UniverseEngine::objectMoved(uint32_t id) {
+    //A rebuild is pending anyway
+    if (!cpuCulling || bvhDirty || id >= objectSpheres.size()) return;
+    bvh.update(id, getObjectBox(id));
+    visibilityChanged = true;
+}
+
+// Box around the bounding sphere of the object moved by its model matrix
+Aabb UniverseEngine::getObjectBox(uint32_t id) {
+    glm::mat4 model = objectSlots[id].obj->getModelMatrix();
+    glm::vec4 s = objectSpheres[id];
+    glm::vec3 center = glm::vec3(model * glm::vec4(glm::vec3(s), 1.0f));
+    float scale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+    glm::vec3 radius = glm::vec3(s.w * scale);
+    return Aabb {center - radius, center + radius};
+}
+
+void UniverseEngine::cullObjects() {
+    if (!cpuCulling) return;
+
+    if (bvhDirty) {
+        objectSpheres.assign(objectSlots.size(), glm::vec4(0.0f));
+        std::vector<Aabb> boxes(objectSlots.size());
+        std::vector<uint32_t> ids;
+        ids.reserve(gameObjs.size());
+        for (auto g : gameObjs) {
+            uint32_t id = g->getId();
+            objectSpheres[id] = g->isInstanced() ? sharedMeshes[g->getMeshHandle().id].bounds : g->getBounds();
+            boxes[id] = getObjectBox(id);
+            ids.push_back(id);
+        }
+        bvh.build(ids, boxes);
+        bvhDirty = false;
+        visibilityChanged = true;
+    }
+    if (!visibilityChanged) return;
+    visibilityChanged = false;
+
+    bvh.refit();
+    bvh.query(viewProj, queryIds);
+    std::sort(queryIds.begin(), queryIds.end());
+    if (queryIds == visibleIds && visibleObjects.size() == objectSlots.size()) return;
+
+    visibleIds.swap(queryIds);
+    visibleObjects.assign(objectSlots.size(), 0);
+    for (auto id : visibleIds) {
+        visibleObjects[id] = 1;
+    }
+
+    //The draws and the instances only have the visible objects, and the ones that came in to the view may have old meshes
+    geometryVersion++;
+    instancesChanged = true;
+    recreateModel();
+}
+
+bool UniverseEngine::isVisible(uint32_t id) {
+    return !cpuCulling || (id < visibleObjects.size() && visibleObjects[id] != 0);
+}
+
+void UniverseEngine::createCullItemBuffers(uint32_t capacity) {
+    cullItemCapacity = capacity;
+    cullItemBuffers.resize(swapChainImages.size());
+    cullItemBuffersMemory.resize(swapChainImages.size());
+    //The count takes the space of one sphere so the items stay aligned
+    VkDeviceSize size = sizeof(CullItem::sphere) + sizeof(CullItem) * capacity;
+    for (size_t i = 0; i < swapChainImages.size(); i++) {
+        createBuffer(&allocator, size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, cullItemBuffers[i], cullItemBuffersMemory[i]);
+    }
+    indirectImageVersions.assign(swapChainImages.size(), UINT64_MAX);
+}
+
+void UniverseEngine::cleanupCullItemBuffers(bool deferred) {
+    for (size_t i = 0; i < cullItemBuffers.size(); i++) {
+        if (deferred) {
+            destroyBufferLater(cullItemBuffers[i], cullItemBuffersMemory[i]);
+        } else {
+            destroyBuffer(&allocator, cullItemBuffers[i], cullItemBuffersMemory[i]);
+        }
+    }
+    cullItemBuffers.clear();
+    cullItemBuffersMemory.clear();
+}
+
+void UniverseEngine::createCullPipeline() {
+    if (unifromBuffers.empty())
+        throw std::runtime_error("culling needs the camera uniform buffer");
+
+    createCullItemBuffers(std::max(cullItemCapacity, (uint32_t) 64));
+
+    //camera, model matrices, items, draws, visible instances
+    std::array<VkDescriptorSetLayoutBinding, 5> bindings {};
+    for (uint32_t b = 0; b < bindings.size(); b++) {
+        bindings[b].binding = b;
+        bindings[b].descriptorType = b == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[b].descriptorCount = 1;
+        bindings[b].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo {};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+    layoutInfo.pBindings = bindings.data();
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &cullSetLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create the cull descriptor set layout");
+    }
+
+    createCullDescriptorSets();
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo {};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &cullSetLayout;
+    //Same range as the graphics pipeline
+    VkPushConstantRange pushRange = pushConstantRange();
+    pipelineLayoutInfo.pushConstantRangeCount = 1;
+    pipelineLayoutInfo.pPushConstantRanges = &pushRange;
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &cullPipelineLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create the cull pipeline layout");
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.stage = cullShader->getPipelineCreateInfo();
+    if (pushConstantSize != 0)
+        pipelineInfo.stage.pSpecializationInfo = &pushConstantsInfo;
+    pipelineInfo.layout = cullPipelineLayout;
+    if (vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &cullPipeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create the cull pipeline");
+    }
+    cullShader->destroyModule();
+}
+
+void UniverseEngine::createCullDescriptorSets() {
+    uint32_t count = static_cast<uint32_t>(swapChainImages.size());
+    std::array<VkDescriptorPoolSize, 2> pools {};
+    pools[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    pools[0].descriptorCount = count;
+    pools[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pools[1].descriptorCount = count * 4;
+
+    VkDescriptorPoolCreateInfo poolInfo {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.poolSizeCount = static_cast<uint32_t>(pools.size());
+    poolInfo.pPoolSizes = pools.data();
+    poolInfo.maxSets = count;
+    if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &cullDescriptorPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create the cull descriptor pool");
+    }
+
+    std::vector<VkDescriptorSetLayout> layouts(count, cullSetLayout);
+    VkDescriptorSetAllocateInfo allocInfo {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = cullDescriptorPool;
+    allocInfo.descriptorSetCount = count;
+    allocInfo.pSetLayouts = layouts.data();
+    cullDescriptorSets.resize(count);
+    if (vkAllocateDescriptorSets(device, &allocInfo, cullDescriptorSets.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate the cull descriptor sets");
+    }
+    writeCullDescriptorSets();
+}
+
+void UniverseEngine::cleanupCullPipeline() {
+    if (cullPipeline == VK_NULL_HANDLE) return;
+
+    vkDestroyPipeline(device, cullPipeline, nullptr);
+    vkDestroyPipelineLayout(device, cullPipelineLayout, nullptr);
+    vkDestroyDescriptorPool(device, cullDescriptorPool, nullptr);
+    vkDestroyDescriptorSetLayout(device, cullSetLayout, nullptr);
+    cullPipeline = VK_NULL_HANDLE;
+    cullDescriptorSets.clear();
+    cleanupCullItemBuffers(false);
+}
+
+void UniverseEngine::writeCullDescriptorSets() {
+    for (size_t i = 0; i < cullDescriptorSets.size(); i++) {
+        std::array<VkDescriptorBufferInfo, 5> infos {};
+        //Not dynamic here, the offset of the image goes in the descriptor
+        infos[0] = {unifromBuffers[0]->getBuffer(i), unifromBuffers[0]->getDynamicOffset(i), unifromBuffers[0]->getSize()};
+        infos[1] = {modelBuffer.getBuffer(i), 0, modelBuffer.getSize()};
+        infos[2] = {cullItemBuffers[i], 0, VK_WHOLE_SIZE};
+        infos[3] = {indirectBuffers[i], 0, VK_WHOLE_SIZE};
+        infos[4] = {instanceBuffer.getBuffer(i), 0, instanceBuffer.getSize()};
+
+        std::array<VkWriteDescriptorSet, 5> sets {};
+        for (uint32_t b = 0; b < sets.size(); b++) {
+            sets[b].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            sets[b].dstSet = cullDescriptorSets[i];
+            sets[b].dstBinding = b;
+            sets[b].dstArrayElement = 0;
+            sets[b].descriptorType = b == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            sets[b].descriptorCount = 1;
+            sets[b].pBufferInfo = &infos[b];
+        }
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(sets.size()), sets.data(), 0, nullptr);
+    }
+}
+
+//Resets the draws to what the host wrote and lets the cull shader add the visible objects to them
+void UniverseEngine::recordCullPass(size_t i) {
+    VkBufferCopy copy {};
+    copy.size = sizeof(VkDrawIndexedIndirectCommand) * indirectCapacity;
+    vkCmdCopyBuffer(commandBuffers[i], drawTemplateBuffers[i], indirectBuffers[i], 1, &copy);
+
+    VkMemoryBarrier barrier {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffers[i], VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+    vkCmdBindDescriptorSets(commandBuffers[i], VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1, &cullDescriptorSets[i], 0, nullptr);
+    if (pushConstantSize != 0)
+        vkCmdPushConstants(commandBuffers[i], cullPipelineLayout, pushConstantStages(), 0, pushConstantSize, pushConstantData.data());
+    //The shader skips what is past the count
+    vkCmdDispatch(commandBuffers[i], (cullItemCapacity + 63) / 64, 1, 1);
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffers[i], VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+//Writes the matrices that changed since this image was last used
+void UniverseEngine::updateModelMatrices(uint32_t index) {
+    if (modelBuffer.getCapacity() < objectSlots.size()) {
+        //The buffers and the descriptor sets are used by the frames in flight
+        modelBuffer.cleanUpLater();
+        modelBuffer.preSwapChainCreate(swapChainImages.size(), modelBufferCapacity());
+        modelImageStamps.assign(swapChainImages.size(), 0);
+        replaceDescriptorSets();
+    }
+
+    uint64_t last = modelImageStamps[index];
+    if (last == modelStamp) return;
+
+    for (size_t i = 0; i < objectSlots.size(); i++) {
+        if (modelStamps[i] <= last || objectSlots[i].obj == nullptr) continue;
+
+        GameObject *o = objectSlots[i].obj;
+        ModelBuffer m {};
+        //When the mesh is baked on the cpu the shader must not move it again
+        m.model = (gpuTransforms || o->isInstanced()) ? o->getModelMatrix() : glm::mat4(1.0f);
+        m.color = glm::vec4(o->getColor(), 1.0f);
+        modelBuffer.updateBuffer(index, i, &m, 1);
+    }
+
+    modelImageStamps[index] = modelStamp;
+}
+
 /*
 
     Getters start
@@ -1894,16 +3391,23 @@ void UniverseEngine::recreateModel() { positionChanged = true; }
 
 VkPhysicalDevice UniverseEngine::getPhyDevice() { return phyDevice; };
 VkDevice UniverseEngine::getDevice() { return device; }
+MemoryAllocator* UniverseEngine::getAllocator(void) { return &allocator; }
+TransformStore* UniverseEngine::getTransforms(void) { return &transforms; }
+JobSystem* UniverseEngine::getJobs(void) { return jobs.get(); }
+StagingRing* UniverseEngine::getStagingRing(void) { return &stagingRing; }
+VkCommandPool UniverseEngine::getCommandPool(void) { return commandPool; }
+VkQueue UniverseEngine::getGraphicsQueue(void) { return graphicsQueue; }
 VkInstance UniverseEngine::getInstance(void) { return instance; }
 VkSurfaceKHR UniverseEngine::getSurface(void) { return surface; }
 VkSurfaceKHR* UniverseEngine::getSurfaceP(void) { return &surface; }
 std::vector<GameObject*> UniverseEngine::getGameObjs() { return gameObjs; }
-uint32_t UniverseEngine::getLastId() { return lastId; }
+uint32_t UniverseEngine::getLastId() { return static_cast<uint32_t>(objectSlots.size()); }
 std::vector<char *> UniverseEngine::getDeviceExtensions() { return deviceExtensions; }
 VkExtent2D UniverseEngine::getExtent() { return swapChainExtent; }
-std::vector<UniformBuffer *> UniverseEngine::getUniformBuffers() { return unifromBuffers; }
+std::vector<UniformBufferBase *> UniverseEngine::getUniformBuffers() { return unifromBuffers; }
 GLFWwindow* UniverseEngine::getWindow() {return window;}
-size_t UniverseEngine::getDescriptorsSize() { return unifromBuffers.size(); }
+size_t UniverseEngine::getDescriptorsSize() { return unifromBuffers.size() + 2; }
+bool UniverseEngine::getGpuTransforms() { return gpuTransforms; }
 
 /* Getters End */
 
@@ -1917,23 +3421,10 @@ size_t UniverseEngine::getDescriptorsSize() { return unifromBuffers.size(); }
 
 PaneObject::PaneObject() {}
 
-PaneObject::PaneObject(UniverseEngine * e, glm::vec3 posIn, glm::vec2 size, glm::vec3 color): GameObject(e) {
-
-    std::vector<Vertex> v = {
-        {{0, 0, 0}, color, {-1.0, -1.0}, 1},
-        {{size.x, 0, 0}, color, {-1.0, -1.0}, 1},
-        {{0, size.y, 0}, color, {-1.0, -1.0}, 1},
-        {{size.x, size.y, 0}, color, {-1.0, -1.0}, 1},
-    };
-    std::vector<uint32_t> i = {
-        0, 1, 2,
-        1, 2, 3
-    };
-    this->vertecies = v;
-    this->indicies = i;
-    this->pos = glm::vec4(posIn, 1.0f);
-    this->vec = glm::vec3(0.0f);
-    this->acc = glm::vec3(0.0f);
+//All the panes are instances of the same quad scaled to their size
+PaneObject::PaneObject(UniverseEngine * e, glm::vec3 posIn, glm::vec2 size, glm::vec3 color): GameObject(e, e->getQuadMesh(), posIn) {
+    this->scale = glm::vec3(size.x, size.y, 1.0f);
+    this->color = color;
 };
 PaneObject::PaneObject(UniverseEngine * e, glm::vec3 pos, glm::vec2 size, glm::vec3 color, glm::mat4 rot): GameObject(e) {
     glm::vec3 s1 = glm::vec3(rot * glm::vec4(size.x, 0, 0, 1));
@@ -9,11 +9,64 @@
 #include <array>
 #include <cstring>
 #include <optional>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <exception>
 #include <vulkan/vulkan.h>
 #include <algorithm>
+#include <cstddef>
+#include <type_traits>
 #include <GLFW/glfw3.h>
 
-#define MAX_FRAMES_IN_FLIGHT 2
+//Frames the cpu can record before waiting for the gpu, changed with setFramesInFlight
+#define DEFAULT_FRAMES_IN_FLIGHT 2
+//Size of the persistently mapped buffer all the uploads go through
+#define STAGING_RING_SIZE (32 * 1024 * 1024)
+//Size of the device memory blocks the resources are suballocated from
+#define MEMORY_BLOCK_SIZE (64 * 1024 * 1024)
+//How many objects are moved in to the holes left by removed objects each frame
+#define COMPACTION_MOVES_PER_FRAME 16
+//Vertices a draw with 16 bit indices can reach from its base vertex
+#define INDEX_PAGE_SIZE 65536
+//Upload the vertices as PackedVertex (half float uvs, 8 bit colors and 16 bit object ids).
+//Off by default because the ids limit a scene to 65536 objects, the cmake option PACKED_VERTICES turns it on
+#ifndef PACKED_VERTICES
+#define PACKED_VERTICES 0
+#endif
+//Objects per job in the tick and mesh building loops
+#define JOB_GRAIN 4096
+//The compiled pipelines are kept here between runs
+#define PIPELINE_CACHE_FILE "pipeline_cache.bin"
+
+//Base alignment and size of the types that can be in a std140 block. For these types std430 gives the same layout,
+//the arrays and nested structs where they are different are not supported
+template <typename M> struct Std140 { static constexpr size_t alignment = 0; static constexpr size_t size = 0; };
+template <> struct Std140<float> { static constexpr size_t alignment = 4; static constexpr size_t size = 4; };
+template <> struct Std140<int32_t> { static constexpr size_t alignment = 4; static constexpr size_t size = 4; };
+template <> struct Std140<uint32_t> { static constexpr size_t alignment = 4; static constexpr size_t size = 4; };
+template <> struct Std140<glm::vec2> { static constexpr size_t alignment = 8; static constexpr size_t size = 8; };
+template <> struct Std140<glm::vec3> { static constexpr size_t alignment = 16; static constexpr size_t size = 12; };
+template <> struct Std140<glm::vec4> { static constexpr size_t alignment = 16; static constexpr size_t size = 16; };
+template <> struct Std140<glm::mat4> { static constexpr size_t alignment = 16; static constexpr size_t size = 64; };
+
+constexpr size_t std140Next(size_t prevOffset, size_t prevSize, size_t alignment) {
+    return (prevOffset + prevSize + alignment - 1) / alignment * alignment;
+}
+
+//The member is where the shader expects it, the first one at 0 and the others right after the previous one
+#define STD140_FIRST(Block, member) \
+    static_assert(Std140<decltype(Block::member)>::alignment != 0, #Block "::" #member " is not a std140 type"); \
+    static_assert(offsetof(Block, member) == 0, #Block "::" #member " must be at the start of the block")
+#define STD140_NEXT(Block, prev, member) \
+    static_assert(Std140<decltype(Block::member)>::alignment != 0, #Block "::" #member " is not a std140 type"); \
+    static_assert(offsetof(Block, member) == std140Next(offsetof(Block, prev), Std140<decltype(Block::prev)>::size, Std140<decltype(Block::member)>::alignment), \
+        #Block "::" #member " is not where std140 puts it")
 
 struct UniformBufferObject
 {
@@ -21,10 +74,17 @@ struct UniformBufferObject
     alignas(16) glm::mat4 proj;
     alignas(16) glm::mat4 model;
 };
+STD140_FIRST(UniformBufferObject, view);
+STD140_NEXT(UniformBufferObject, view, proj);
+STD140_NEXT(UniformBufferObject, proj, model);
 
 struct ModelBuffer {
     glm::mat4 model;
+    //Instanced objects use it instead of the vertex color
+    glm::vec4 color;
 };
+STD140_FIRST(ModelBuffer, model);
+STD140_NEXT(ModelBuffer, model, color);
 
 struct SwapChainSupportDetails
 {
@@ -44,15 +104,112 @@ struct QueueFamilyIndices
     }
 };
 
+enum MemoryStrategy {
+    //Best fit out of a list of free ranges, freed ranges are merged back
+    MEMORY_STRATEGY_FREE_LIST,
+    //Allocations are put one after the other, the block is reused once all of them were freed
+    MEMORY_STRATEGY_LINEAR,
+};
+
+struct MemoryAllocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    //Only set for host visible memory
+    void *mapped = nullptr;
+    uint32_t memoryType = 0;
+    uint32_t pool = 0;
+    uint32_t block = 0;
+};
+
+struct MemoryStats {
+    uint32_t blockCount = 0;
+    uint32_t allocationCount = 0;
+    //Memory allocated from the driver
+    VkDeviceSize bytesAllocated = 0;
+    //Memory given to resources
+    VkDeviceSize bytesUsed = 0;
+    VkDeviceSize largestFreeRange = 0;
+    //0 when all the free memory is in one range, close to 1 when it is split in many small ones
+    float fragmentation = 0;
+};
+
+//Hands out ranges of big device memory blocks instead of doing one vkAllocateMemory per resource.
+//There is a pool of blocks per memory type and strategy
+class MemoryAllocator {
+public:
+    MemoryAllocator();
+    MemoryAllocator(VkPhysicalDevice phyDevice, VkDevice device);
+    void create();
+    //Frees all the blocks, the resources must be destroyed before
+    void cleanUp();
+    //linear is true for buffers and linear tiled images
+    MemoryAllocation allocate(VkMemoryRequirements reqs, VkMemoryPropertyFlags props, bool linear, MemoryStrategy strategy = MEMORY_STRATEGY_FREE_LIST);
+    void free(MemoryAllocation &allocation);
+    MemoryStats getStats();
+    MemoryStats getStats(uint32_t memoryType);
+    void printStats();
+    VkDevice getDevice();
+    VkPhysicalDevice getPhyDevice();
+
+private:
+    struct Range {
+        VkDeviceSize offset;
+        VkDeviceSize size;
+    };
+
+    struct Block {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize size = 0;
+        char *mapped = nullptr;
+        //Free list blocks, sorted by offset
+        std::vector<Range> freeRanges;
+        //Linear blocks
+        VkDeviceSize head = 0;
+        uint32_t allocations = 0;
+        VkDeviceSize used = 0;
+        //Holds a single big resource and is freed with it
+        bool dedicated = false;
+    };
+
+    struct Pool {
+        uint32_t memoryType;
+        bool linear;
+        MemoryStrategy strategy;
+        std::vector<Block> blocks;
+    };
+
+    VkPhysicalDevice phyDevice = VK_NULL_HANDLE;
+    VkDevice device = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memProperties;
+    VkDeviceSize granularity = 1;
+    VkDeviceSize nonCoherentAtom = 1;
+    uint32_t maxAllocations = 0;
+    uint32_t driverAllocations = 0;
+
+    std::vector<Pool> pools;
+
+    bool suballocate(Pool &pool, Block &block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize &offset);
+    uint32_t getPool(uint32_t memoryType, bool linear, MemoryStrategy strategy);
+    VkDeviceSize getBlockSize(uint32_t memoryType, MemoryStrategy strategy);
+    uint32_t addBlock(Pool &pool, VkDeviceSize size, bool dedicated);
+    void releaseBlock(Block &block);
+};
+
 uint32_t findMemoryType(VkPhysicalDevice phyDevice, uint32_t typeFilter, VkMemoryPropertyFlags props);
-void createBuffer(VkDevice device, VkPhysicalDevice phyDevice, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer &buffer, VkDeviceMemory &bufferMemory);
+void createBuffer(MemoryAllocator *allocator, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer &buffer, MemoryAllocation &allocation, MemoryStrategy strategy = MEMORY_STRATEGY_FREE_LIST);
+void destroyBuffer(MemoryAllocator *allocator, VkBuffer &buffer, MemoryAllocation &allocation);
 void copyBuffer(VkDevice device, VkCommandPool pool, VkQueue queue, VkBuffer source, VkBuffer dstBuffer, VkDeviceSize size);
-void createImage(VkDevice device, VkPhysicalDevice phyDevice, uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags mempProps, VkImage image, VkDeviceMemory imageMemory);
+void copyBufferRegions(VkDevice device, VkCommandPool pool, VkQueue queue, VkBuffer source, VkBuffer dstBuffer, std::vector<VkBufferCopy> regions);
+void createImage(MemoryAllocator *allocator, uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags mempProps, VkImage &image, MemoryAllocation &imageMemory);
 VkCommandBuffer beginCommands(VkDevice device, VkCommandPool commandPool, VkCommandBufferUsageFlags flags);
 VkCommandBuffer beginSingleCommands(VkDevice device, VkCommandPool commandPool);
 void endSigleTimeCommands(VkQueue graphicsQueue, VkDevice device, VkCommandPool pool, VkCommandBuffer commandBuffer);
 void transitionImageLayout(VkQueue queue, VkDevice device, VkCommandPool pool, VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout);
-void copyBufferToImage(VkDevice device, VkCommandPool pool, VkQueue queue, uint32_t width, uint32_t height, VkBuffer buffer, VkImage image);
+void recordImageTransition(VkCommandBuffer commandBuffer, VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout);
+void copyBufferToImage(VkDevice device, VkCommandPool pool, VkQueue queue, uint32_t width, uint32_t height, VkBuffer buffer, VkImage image, VkDeviceSize bufferOffset = 0);
+//Copies height rows starting at firstRow of the image
+void recordBufferToImage(VkCommandBuffer commandBuffer, uint32_t width, uint32_t height, VkBuffer buffer, VkImage image, VkDeviceSize bufferOffset = 0, uint32_t firstRow = 0);
 bool hasStencilComponent(VkFormat format);
 std::vector<const char *> getRequiredExtensions(bool enableValidationLayers);
 bool checkValidationLayerSupport(std::vector<const char *> validationLayers);
@@ -71,14 +228,20 @@ public:
     MImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags mempProps, VkImageAspectFlags flags);
     void clean(VkDevice device);
     VkImage getImage(void);
-    void create(VkDevice device, VkPhysicalDevice phyDevice);
+    void create(MemoryAllocator *allocator);
     void changeLayout(VkDevice device, VkQueue queue, VkCommandPool pool, VkImageLayout newLayout);
+    //Only records the transition
+    void changeLayout(VkCommandBuffer commandBuffer, VkImageLayout newLayout);
     void createImageView(VkDevice device);
     VkImageView getImageView();
+    uint32_t getWidth();
+    uint32_t getHeight();
+    VkFormat getFormat();
 
 private:
     VkImage image;
-    VkDeviceMemory imageMemory;
+    MemoryAllocation imageMemory;
+    MemoryAllocator *allocator;
     VkImageView imageView;
 
     uint32_t width;
@@ -91,6 +254,91 @@ private:
     VkImageAspectFlags viewFlags;
 };
 
+struct StagingAllocation {
+    VkBuffer buffer;
+    //Offset in buffer
+    VkDeviceSize offset;
+    //Where to write the data
+    void *data;
+};
+
+//Persistently mapped host visible buffer that the uploads to the gpu are staged in.
+//Allocations are handed out in order and wrap around, a region is only reused after
+//the fence of the submission that read it was signaled
+class StagingRing {
+public:
+    StagingRing();
+    StagingRing(UniverseEngine *en, VkDeviceSize size);
+    void create();
+    void cleanUp();
+    //Waits for older submissions if the ring is full
+    StagingAllocation allocate(VkDeviceSize size, VkDeviceSize alignment = 16);
+    //Closes the allocations made since the last call, the returned fence must be
+    //signaled by the submission that reads them. Returns VK_NULL_HANDLE if there are none.
+    //The command buffer is freed once the fence is signaled
+    VkFence retire(VkCommandBuffer commandBuffer = VK_NULL_HANDLE);
+    VkBuffer getBuffer();
+    VkDeviceSize getSize();
+
+private:
+    struct Region {
+        //Position after the last byte of the region
+        VkDeviceSize end;
+        VkFence fence;
+        VkCommandBuffer commandBuffer;
+    };
+
+    UniverseEngine *en;
+    VkBuffer buffer = VK_NULL_HANDLE;
+    MemoryAllocation memory;
+    char *mapped = nullptr;
+    VkDeviceSize size = 0;
+
+    //Positions only grow, the offset in the buffer is position % size
+    VkDeviceSize head = 0;
+    VkDeviceSize tail = 0;
+    //Start of the allocations that were not retired yet
+    VkDeviceSize openStart = 0;
+
+    std::deque<Region> inFlight;
+    std::vector<VkFence> freeFences;
+
+    void reclaim();
+    void waitOldest();
+};
+
+//Records copies and layout changes in one command buffer that is submitted once.
+//The data is staged in the engine staging ring and submit does not wait for the gpu
+class UploadBatch {
+public:
+    UploadBatch();
+    UploadBatch(UniverseEngine *en);
+    //Frees what was recorded and not submitted
+    ~UploadBatch();
+    //The batch owns its command buffer
+    UploadBatch(const UploadBatch &) = delete;
+    UploadBatch &operator=(const UploadBatch &) = delete;
+    void copyToBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void *data, VkDeviceSize size);
+    //Copies the regions of src (srcOffset is the offset in src) to dst
+    void copyRegions(VkBuffer dst, const void *src, const std::vector<VkBufferCopy> &regions);
+    void copyRegions(VkBuffer dst, const void *src, const VkBufferCopy *regions, size_t count);
+    void changeLayout(MImage *image, VkImageLayout newLayout);
+    //Leaves the image ready to be sampled. Images bigger than half the staging ring are staged a group of rows at a time
+    void uploadImage(MImage *image, const void *pixels, VkDeviceSize size);
+    //Submits what was recorded, the batch can be used again after
+    void submit();
+    bool isEmpty();
+
+private:
+    UniverseEngine *en;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    //Bytes staged since the last submit
+    VkDeviceSize staged = 0;
+
+    void begin();
+    StagingAllocation stage(VkDeviceSize size, VkDeviceSize alignment);
+};
+
 class MSampler {
 public:
     MSampler();
@@ -102,68 +350,321 @@ private:
     VkSampler sampler;
 };
 
-struct Vertex {
-    alignas(16) glm::vec3 pos;
-    alignas(16) glm::vec3 color;
-    alignas(16) glm::vec2 texCoord;
-    alignas(16) float colorOn;
-    alignas(16) uint32_t gameObjId;
+//One attribute of a vertex, its location is its position in the VertexLayout
+template<VkFormat Format, uint32_t Offset>
+struct VertexAttribute {
+    static constexpr VkFormat format = Format;
+    static constexpr uint32_t offset = Offset;
+};
 
+//Describes the vertex V to the pipeline from the list of its attributes
+template<typename V, typename... Attributes>
+struct VertexLayout {
     //How to read the data
     static VkVertexInputBindingDescription getBindingDescription()
     {
         VkVertexInputBindingDescription desc;
         desc.binding = 0;
-        desc.stride = sizeof(Vertex);
+        desc.stride = sizeof(V);
         desc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
         return desc;
     }
 
     //what the data means
-    static std::array<VkVertexInputAttributeDescription, 5> getAttributeDescription()
+    static std::array<VkVertexInputAttributeDescription, sizeof...(Attributes)> getAttributeDescription()
     {
-        std::array<VkVertexInputAttributeDescription, 5> array;
-
-        array[0].binding = 0;
-        array[0].location = 0;
-        array[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-        array[0].offset = offsetof(Vertex, pos);
-
-        array[1].binding = 0;
-        array[1].location = 1;
-        array[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-        array[1].offset = offsetof(Vertex, color);
+        std::array<VkVertexInputAttributeDescription, sizeof...(Attributes)> array;
+        uint32_t location = 0;
+        ((array[location] = VkVertexInputAttributeDescription {location, 0, Attributes::format, Attributes::offset}, location++), ...);
+        return array;
+    }
+};
 
-        array[2].binding = 0;
-        array[2].location = 2;
-        array[2].format = VK_FORMAT_R32G32_SFLOAT;
-        array[2].offset = offsetof(Vertex, texCoord);
+//The vertices game objects are made of
+struct Vertex {
+    glm::vec3 pos;
+    glm::vec3 color;
+    glm::vec2 texCoord;
+    float colorOn;
+    uint32_t gameObjId;
+};
 
-        array[3].binding = 0;
-        array[3].location = 3;
-        array[3].format = VK_FORMAT_R32_SFLOAT;
-        array[3].offset = offsetof(Vertex, color);
+typedef VertexLayout<Vertex,
+    VertexAttribute<VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, pos)>,
+    VertexAttribute<VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, color)>,
+    VertexAttribute<VK_FORMAT_R32G32_SFLOAT, offsetof(Vertex, texCoord)>,
+    VertexAttribute<VK_FORMAT_R32_SFLOAT, offsetof(Vertex, colorOn)>,
+    VertexAttribute<VK_FORMAT_R32_UINT, offsetof(Vertex, gameObjId)>
+> VertexFormat;
+
+//Same data as Vertex in 24 bytes, the shader reads it the same way
+struct PackedVertex {
+    float pos[3];
+    //Two half floats
+    uint32_t texCoord;
+    //rgba8 unorm
+    uint32_t color;
+    uint16_t gameObjId;
+    //snorm, only its sign is used
+    int8_t colorOn;
+    uint8_t padding;
+};
+static_assert(sizeof(PackedVertex) == 24, "PackedVertex has to stay 24 bytes");
+
+typedef VertexLayout<PackedVertex,
+    VertexAttribute<VK_FORMAT_R32G32B32_SFLOAT, offsetof(PackedVertex, pos)>,
+    VertexAttribute<VK_FORMAT_R8G8B8A8_UNORM, offsetof(PackedVertex, color)>,
+    VertexAttribute<VK_FORMAT_R16G16_SFLOAT, offsetof(PackedVertex, texCoord)>,
+    VertexAttribute<VK_FORMAT_R8_SNORM, offsetof(PackedVertex, colorOn)>,
+    VertexAttribute<VK_FORMAT_R16_UINT, offsetof(PackedVertex, gameObjId)>
+> PackedVertexFormat;
+
+inline void packVertex(const Vertex &v, Vertex &out) {
+    out = v;
+}
 
-        array[4].binding = 0;
-        array[4].location = 4;
-        array[4].format = VK_FORMAT_R32_UINT;
-        array[4].offset = offsetof(Vertex, gameObjId);
+inline void packVertex(const Vertex &v, PackedVertex &out) {
+    out.pos[0] = v.pos.x;
+    out.pos[1] = v.pos.y;
+    out.pos[2] = v.pos.z;
+    out.texCoord = glm::packHalf2x16(v.texCoord);
+    out.color = glm::packUnorm4x8(glm::vec4(v.color, 1.0f));
+    out.gameObjId = static_cast<uint16_t>(v.gameObjId);
+    out.colorOn = v.colorOn < 0.0f ? -127 : 127;
+    out.padding = 0;
+}
 
-        return array;
-    }
-};
+//What the vertex buffer holds
+#if PACKED_VERTICES
+typedef PackedVertex GpuVertex;
+typedef PackedVertexFormat GpuVertexFormat;
+#else
+typedef Vertex GpuVertex;
+typedef VertexFormat GpuVertexFormat;
+#endif
 
 struct Mesh {
     std::vector<Vertex> v;
     std::vector<uint32_t> i;
 };
 
+//Where the mesh of a game object is stored in the vertex and index buffers
+struct MeshRange {
+    uint32_t vertexOffset;
+    uint32_t vertexCount;
+    uint32_t indexOffset;
+    uint32_t indexCount;
+};
+
+//Part of the index buffer drawn with one base vertex
+struct DrawBatch {
+    uint32_t firstIndex;
+    uint32_t indexCount;
+    int32_t vertexOffset;
+    uint32_t firstInstance;
+    uint32_t instanceCount;
+};
+
+//Object tested by the cull shader, it is added to the draw command when its sphere is in the frustum
+struct CullItem {
+    //Center and radius in object space
+    glm::vec4 sphere;
+    uint32_t object;
+    uint32_t command;
+    uint32_t padding[2];
+};
+
+//Jobs that were given the same counter can be waited on together
+struct JobCounter {
+    std::atomic<uint32_t> pending {0};
+};
+
+//Resources that the frames in flight might still use. Each one is tagged with the number of
+//frames submitted when it was replaced and destroyed once the gpu is done with those frames
+class DeletionQueue {
+public:
+    void push(uint64_t frame, std::function<void()> destroy);
+    //Destroys everything tagged with frame or before
+    void flush(uint64_t frame);
+    void flushAll();
+    size_t size();
+
+private:
+    struct Entry {
+        uint64_t frame;
+        std::function<void()> destroy;
+    };
+    std::deque<Entry> entries;
+};
+
+//Pool of worker threads with one queue each. A thread runs the newest job of its own
+//queue and steals the oldest job of the other queues when it has nothing to do
+class JobSystem {
+public:
+    JobSystem();
+    ~JobSystem();
+    //0 uses one thread per core, the thread that waits for the jobs counts as one
+    void create(uint32_t threadCount = 0);
+    void cleanUp();
+    //The job only starts after the jobs of dependency are done, until then it is kept out of the queues. counter can be nullptr
+    void run(std::function<void()> job, JobCounter *counter, JobCounter *dependency = nullptr);
+    //Runs other jobs while it waits
+    void wait(JobCounter *counter);
+    //Calls fn(begin, end) for chunks of grain items of [0, count) and waits for all of them
+    void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)> &fn);
+    uint32_t getThreadCount();
+
+private:
+    struct Job {
+        std::function<void()> fn;
+        JobCounter *counter = nullptr;
+        JobCounter *dependency = nullptr;
+    };
+
+    //The jobs from head to the end are queued. A vector keeps its memory, so queueing does not allocate once it grew
+    struct Worker {
+        std::mutex mutex;
+        std::vector<Job> jobs;
+        size_t head = 0;
+    };
+
+    //Chunks of a parallelFor that the jobs take from
+    struct ForState {
+        const std::function<void(size_t, size_t)> *fn;
+        size_t count;
+        size_t grain;
+        std::atomic<size_t> next {0};
+        //First exception thrown by fn, parallelFor throws it again once every job is done
+        std::mutex errorMutex;
+        std::exception_ptr error;
+    };
+
+    std::vector<std::unique_ptr<Worker>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<bool> running {false};
+
+    //The workers sleep while there are no jobs. It is increased before a job is pushed and decreased after it is taken,
+    //so it is never lower than the number of queued jobs
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<int32_t> queued {0};
+
+    //Jobs whose dependency is not done yet
+    std::mutex parkMutex;
+    std::vector<Job> parked;
+
+    static thread_local size_t queueIndex;
+
+    void enqueue(Job job);
+    static void runChunks(ForState &state);
+    void release(JobCounter *counter);
+    bool runOne(size_t self);
+    void workerLoop(size_t index);
+};
+
+struct Aabb {
+    glm::vec3 low;
+    glm::vec3 high;
+};
+
+//Bounding volume hierarchy over the boxes of the objects, built with the surface area heuristic.
+//Moving objects only refits the boxes on the way from their leaf to the root
+class Bvh {
+public:
+    //boxes is indexed by gameObjId, only the ids in the list are added
+    void build(const std::vector<uint32_t> &ids, const std::vector<Aabb> &boxes);
+    //Changes the box of an object, the tree is fixed on the next refit
+    void update(uint32_t id, Aabb box);
+    void refit();
+    //Ids of the objects whose box is at least partly inside the frustum of the matrix
+    void query(const glm::mat4 &viewProj, std::vector<uint32_t> &visible);
+    size_t size();
+
+private:
+    struct Node {
+        Aabb box;
+        //Children for inner nodes, 0 for leaves (the root is never a child). The range in items covers
+        //every leaf under the node, the children split the range of their parent
+        uint32_t left;
+        uint32_t right;
+        uint32_t first;
+        uint32_t count;
+        uint32_t parent;
+    };
+    std::vector<Node> nodes;
+    std::vector<uint32_t> items;
+    std::vector<Aabb> boxes;
+    //Leaf that has each id, UINT32_MAX when it is not in the tree
+    std::vector<uint32_t> leafOf;
+    std::vector<uint32_t> dirtyLeaves;
+    //One per node, set while the leaf is in dirtyLeaves so many moved objects in it only add it once
+    std::vector<uint8_t> leafDirty;
+
+    uint32_t split(uint32_t first, uint32_t count, std::vector<glm::vec3> &centers);
+    void addItems(uint32_t node, std::vector<uint32_t> &visible);
+};
+
+//Simulation state of the objects added to the engine, one array per component so that
+//the tick goes through memory in order. Indexed by gameObjId
+class TransformStore {
+public:
+    void resize(size_t count);
+    size_t size();
+    void set(uint32_t id, glm::vec3 pos, glm::vec3 vec, glm::vec3 acc, glm::mat4 rot);
+    //Resets a free id so that it does not move
+    void clear(uint32_t id);
+    //Adds the accelaration to the velocity and the velocity to the position of every id,
+    //moved gets the ids that have a velocity. Uses AVX2 or SSE when the cpu has them
+    void integrate(std::vector<uint32_t> &moved);
+    //Only integrates [begin, end), begin must be a multiple of 8. Different ranges can run in parallel
+    void integrateRange(size_t begin, size_t end);
+    //Ids that moved in the last integration
+    void collectMoved(std::vector<uint32_t> &moved);
+    //Integrates one object at a time even when the cpu has AVX2 or SSE, to compare against them
+    void setScalar(bool scalar);
+
+    glm::vec3 getPos(uint32_t id);
+    glm::vec3 getVec(uint32_t id);
+    glm::vec3 getAcc(uint32_t id);
+    glm::mat4 getRot(uint32_t id);
+    void setPos(uint32_t id, glm::vec3 pos);
+    void setVec(uint32_t id, glm::vec3 vec);
+    void setAcc(uint32_t id, glm::vec3 acc);
+    void setRot(uint32_t id, glm::mat4 rot);
+
+private:
+    std::vector<float> posX, posY, posZ;
+    std::vector<float> vecX, vecY, vecZ;
+    std::vector<float> accX, accY, accZ;
+    std::vector<glm::mat4> rot;
+    //One bit per object, set by integrate when the object moved
+    std::vector<uint8_t> dirty;
+    bool scalar = false;
+};
+
+//Refers to an object added to the engine, it stops being valid when the object is removed
+//even if the id is given to another object
+struct ObjectHandle {
+    uint32_t id = UINT32_MAX;
+    uint32_t generation = 0;
+};
+
+//Center and radius (w) of a sphere around the vertices
+glm::vec4 getBoundingSphere(const std::vector<Vertex> &vertecies);
+
+//Refers to a mesh registered in the engine, the objects that use it are drawn as instances of it
+struct MeshHandle {
+    uint32_t id = UINT32_MAX;
+};
+
 class GameObject {
 public:
 GameObject();
     GameObject(UniverseEngine * e);
     GameObject(UniverseEngine * e, std::vector<Vertex> vertecies, std::vector<uint32_t> indicies, glm::vec3 pos);
+    //Uses a registered mesh instead of its own vertices
+    GameObject(UniverseEngine * e, MeshHandle mesh, glm::vec3 pos);
     //Basic method that will add the accelaration the speed and the speed to the pos
     void tick(void);
     //Basic method that will add a with accelaration then add the accelaration the speed and the speed to the pos
@@ -173,15 +674,37 @@ GameObject();
     void updateVec(glm::vec3 vec);
     void updateAcc(glm::vec3 acc);
     void updateRot(glm::mat4 rot);
+    //Only used by instanced objects, the others have the color in the vertices
+    void setColor(glm::vec3 color);
+    void setScale(glm::vec3 scale);
     
     glm::vec3 getPos();
     glm::vec3 getVec();
     glm::vec3 getAcc();
+    glm::mat4 getRot();
+    glm::vec3 getColor();
+    glm::vec3 getScale();
+    glm::mat4 getModelMatrix();
+    MeshHandle getMeshHandle();
+    bool isInstanced();
+    //The vertices are in world space unless the engine uses gpu transforms
     Mesh getMesh();
+    //Same as getMesh but writes into dst and idst (when not null) without copying, the indices get base added
+    void transformInto(GpuVertex *dst, uint32_t *idst, uint32_t base);
+    uint32_t getVertexCount();
+    uint32_t getIndexCount();
+    //Sphere around the vertices in object space, w is the radius
+    glm::vec4 getBounds();
     bool hasMeshChanged();
+    //Called by the engine after the mesh was uploaded
+    void clearMeshChanged();
     void setId(uint32_t id);
+    uint32_t getId();
+    //Called when the position or the rotation changed
+    void transformChanged();
 
 protected:
+    //While the object is added to the engine these are kept in the engine TransformStore
     //Position
     glm::vec3 pos;
     //velocity
@@ -191,11 +714,16 @@ protected:
 
     glm::mat4 rot;
 
+    glm::vec3 color = glm::vec3(1.0f);
+    glm::vec3 scale = glm::vec3(1.0f);
+    //Registered mesh the object is an instance of
+    MeshHandle mesh;
+
     bool meshChanged;
 
     UniverseEngine * e;
 
-    uint32_t id;
+    uint32_t id = UINT32_MAX;
     void updateVerticeId();
     //protected:
     std::vector<Vertex> vertecies;
@@ -242,7 +770,7 @@ public:
 
         //For uniform buffer
         std::vector<VkBuffer> uniformBuffers;
-        std::vector<VkDeviceMemory> uniformBuffersMemory;
+        std::vector<MemoryAllocation> uniformBuffersMemory;
     public:
         VkDescriptorSetLayoutBinding virtual getDescriptorSetLayoutBinding() = 0;
         void virtual preSwapChainCreate(size_t swapChainSize) = 0;
@@ -252,31 +780,63 @@ public:
         void setId(size_t id);
 }; */
 
-//TODO: maybe add generics
-class UniformBuffer {
+//The part of a uniform buffer the engine works with, the data is written through UniformBuffer<T>
+class UniformBufferBase {
     private:
         size_t id;
         VkShaderStageFlags flags;
         UniverseEngine *en;
-        std::vector<VkBuffer> uniformBuffers;
-        std::vector<VkDeviceMemory> uniformBuffersMemory;
+        VkDeviceSize size = 0;
+        //Slice of the uniform arena of the engine, there is one every stride bytes for each swapchain image
+        VkBuffer arena = VK_NULL_HANDLE;
+        char *mapped = nullptr;
+        VkDeviceSize offset = 0;
+        VkDeviceSize stride = 0;
+        //Copy of what was written for each image, so that only the bytes that changed are written again
+        std::vector<char> written;
+        std::vector<bool> writtenValid;
     public:
-        UniformBuffer();
-        UniformBuffer(UniverseEngine *en, VkShaderStageFlags flags);
+        UniformBufferBase();
+        UniformBufferBase(UniverseEngine *en, VkShaderStageFlags flags, VkDeviceSize size);
         VkWriteDescriptorSet getWriterDescriptorSet();
         //VkDescriptorBufferInfo getWriterDescriptorBufferInfo(uint32_t index);
 
         VkBuffer getBuffer(uint32_t index);
         VkDeviceSize getSize();
+        //Offset of the data of the image in the arena, bound as a dynamic offset
+        uint32_t getDynamicOffset(uint32_t index);
 
         VkDescriptorSetLayoutBinding getDescriptorSetLayoutBinding();
-        void preSwapChainCreate(size_t swapChainSize);
+        void preSwapChainCreate(VkBuffer arena, char *mapped, VkDeviceSize offset, VkDeviceSize stride);
         void cleanUp();
         VkDescriptorType getType();
         void setId(size_t);
         size_t getId();
-        // TODO: maybe change
-        void updateUniformBuffer(uint32_t index, UniformBufferObject obj);
+        //Writes the bytes of the block that are different from the last write of the image
+        void updateChanged(uint32_t index, const void *data);
+        //Writes size bytes at offset in the block of the image
+        void updateRange(uint32_t index, VkDeviceSize offset, const void *data, VkDeviceSize size);
+};
+
+template <typename T>
+class UniformBuffer : public UniformBufferBase {
+    static_assert(std::is_trivially_copyable<T>::value && std::is_standard_layout<T>::value, "uniform blocks are copied byte by byte");
+    static_assert(sizeof(T) % 16 == 0, "std140 blocks are padded to a multiple of 16 bytes");
+    public:
+        UniformBuffer() {}
+        UniformBuffer(UniverseEngine *en, VkShaderStageFlags flags) : UniformBufferBase(en, flags, sizeof(T)) {}
+
+        //The memory is coherent so the writes go straight to the gpu
+        void updateUniformBuffer(uint32_t index, const T &obj) {
+            updateChanged(index, &obj);
+        }
+        //Only writes one member, like ub.updateMember(i, &UniformBufferObject::view, view)
+        template <typename M>
+        void updateMember(uint32_t index, M T::*member, const M &value) {
+            static const T probe {};
+            VkDeviceSize offset = (const char *) &(probe.*member) - (const char *) &probe;
+            updateRange(index, offset, &value, sizeof(M));
+        }
 };
 template <typename T>
 class ShaderStorageBuffer {
@@ -285,8 +845,8 @@ class ShaderStorageBuffer {
         VkShaderStageFlags flags;
         UniverseEngine *en;
         std::vector<VkBuffer> ssBuffers;
-        std::vector<VkDeviceMemory> ssBuffersMemory;
-        VkDeviceSize bufferSize;
+        std::vector<MemoryAllocation> ssBuffersMemory;
+        VkDeviceSize bufferSize = 0;
     public:
         ShaderStorageBuffer<T>();
         ShaderStorageBuffer<T>(UniverseEngine *en, VkShaderStageFlags flags);
@@ -295,14 +855,20 @@ class ShaderStorageBuffer {
 
         VkBuffer getBuffer(uint32_t index);
         VkDeviceSize getSize();
+        //Number of T that fit in each buffer
+        size_t getCapacity();
         
         VkDescriptorSetLayoutBinding getDescriptorSetLayoutBinding();
         void preSwapChainCreate(size_t swapChainSize, size_t gameobjs);
         void cleanUp();
+        //The buffers are destroyed once the frames in flight are done with them
+        void cleanUpLater();
         VkDescriptorType getType();
         void setId(size_t);
         size_t getId();
-        void updateBuffer(uint32_t index, std::vector<T> obj);
+        void updateBuffer(uint32_t index, const std::vector<T> &obj);
+        //Writes count elements starting at the element first
+        void updateBuffer(uint32_t index, size_t first, const T *obj, size_t count);
 };
 
 /*class ImageDescriptor : public Descriptor {
@@ -316,7 +882,17 @@ public:
     UniverseEngine(GLFWwindow *window, std::vector<const char *> validationLayers);
     void cleanup();
 
-    void addGameobject(GameObject *obj);
+    ObjectHandle addGameobject(GameObject *obj);
+    //Adds all the objects and builds the geometry only once
+    std::vector<ObjectHandle> addGameobjects(const std::vector<GameObject *> &objs);
+    //The id of the object is reused, its geometry is left as a hole that is filled over the next frames
+    void removeGameobject(ObjectHandle handle);
+    //Returns nullptr if the object was removed
+    GameObject *getGameobject(ObjectHandle handle);
+    bool isAlive(ObjectHandle handle);
+    //The objects added between begin and commit only build the geometry at commit, can be nested
+    void beginObjects();
+    void commitObjects();
     void updateObject(GameObject obj);
 
     void lockPipelineData();
@@ -335,12 +911,53 @@ public:
 
     //Adders ----
     void addDeviceExtencions(char *);
-    void addUniformBuffer(UniformBuffer* buffer);
+    void addUniformBuffer(UniformBufferBase* buffer);
     //void addDescriptor(Descriptor *);
     //----
 
     //Creates the vertex and index buffers for the current loaded gameobjects
     void createModelData();
+    //Places the meshes of the objects in vertecies and indicies without uploading them, a rebuild runs it
+    void layoutModelData();
+    //The index data copyIndexRegions uploads for the regions (in indices), with shortIndices the 16 bit copy is filled for them first
+    const void *packIndexRegions(const VkBufferCopy *regions, size_t count);
+
+    //Meshes shared by many objects, they are stored once and drawn with one instanced draw
+    MeshHandle registerMesh(std::vector<Vertex> vertecies, std::vector<uint32_t> indicies);
+    //Quad from (0, 0) to (1, 1) used by the panes
+    MeshHandle getQuadMesh();
+
+    //Culls the objects on the gpu with the compute shader before drawing, using the view and proj of the
+    //first uniform buffer. Needs drawIndirectFirstInstance, without it everything is drawn. Set before createPipeline
+    void enableCulling(Shader *shader);
+    //Leaves out the objects outside of the view before their meshes are updated and drawn, using a bvh of their bounds.
+    //The matrix is the proj * view the shader uses, the depth going from 0 to 1
+    void setCpuCulling(bool enabled);
+    void setViewProjection(glm::mat4 viewProj);
+    //Marks the bounds of the object as moved, the bvh is refit before the next cull
+    void objectMoved(uint32_t id);
+
+    //Sends size bytes to the shaders as push constants, the shaders read them when the specialization constant 0 is true.
+    //Without it the shaders keep using the uniform buffer. They stay off (usesPushConstants is false) when size is over
+    //maxPushConstantsSize or the device has no multiDrawIndirect, the uniform buffer is used then. Set before createPipeline
+    void enablePushConstants(uint32_t size);
+    bool usesPushConstants();
+    //Used by the frames drawn after, their command buffers are recorded in draw with them
+    void setPushConstants(const void *data, uint32_t size);
+
+    //Uploads the pixels through the staging ring and leaves the image ready to be sampled
+    void uploadImage(MImage *image, const void *pixels, VkDeviceSize size);
+
+    //When enabled the meshes are uploaded once in object space and the vertex shader
+    //reads the model matrix of each object from a storage buffer indexed by gameObjId
+    void setGpuTransforms(bool enabled);
+    bool getGpuTransforms();
+    //Marks the model matrix of the object as changed
+    void updateModelMatrix(uint32_t id);
+
+    //Runs destroy once the frames submitted until now are done on the gpu
+    void destroyLater(std::function<void()> destroy);
+    void destroyBufferLater(VkBuffer buffer, MemoryAllocation memory);
 
     //GET
     uint32_t getLastId();
@@ -350,14 +967,29 @@ public:
     VkSurfaceKHR *getSurfaceP(void);
     VkPhysicalDevice getPhyDevice(void);
     VkDevice getDevice(void);
+    MemoryAllocator *getAllocator(void);
+    TransformStore *getTransforms(void);
+    JobSystem *getJobs(void);
+    StagingRing *getStagingRing(void);
+    VkCommandPool getCommandPool(void);
+    VkQueue getGraphicsQueue(void);
     GLFWwindow *getWindow(void);
     std::vector<char *> getDeviceExtensions();
     VkExtent2D getExtent();
     size_t getDescriptorsSize();
     //std::vector<Descriptor *> getDescriptors();
-    std::vector<UniformBuffer *> getUniformBuffers();
+    std::vector<UniformBufferBase *> getUniformBuffers();
 
     // Drawing  ----
+    //More frames in flight give more throughput, fewer give less latency. Set before createSyncObjects
+    void setFramesInFlight(uint32_t count);
+    //Frames are numbered from 1 in the order they are submitted. Uploads, deletions and readbacks can wait
+    //for the last frame that used their data
+    uint64_t getSubmittedFrame();
+    uint64_t getCompletedFrame();
+    void waitForFrame(uint64_t frame);
+    //Without timeline semaphores the frames are waited with a fence each
+    bool usesTimelineSemaphores();
     uint32_t getCurrentImage();
     void draw();
     void framBufferResize();
@@ -366,7 +998,7 @@ public:
     // ----
 
     //public fileds
-    std::vector<Vertex> vertecies;
+    std::vector<GpuVertex> vertecies;
     std::vector<uint32_t> indicies;
 
 private:
@@ -375,7 +1007,6 @@ private:
     std::vector<char *> deviceExtensions;
     std::vector<const char *> validationLayers;
 
-    uint32_t lastId;
     VkInstance instance;
     VkDebugUtilsMessengerEXT debuggerMenssenger;
     bool enableValidationLayers;
@@ -388,6 +1019,9 @@ private:
     VkPhysicalDevice phyDevice;
     VkDevice device;
 
+    //All the buffers and images get their memory from here
+    MemoryAllocator allocator;
+
     VkQueue graphicsQueue;
     VkQueue presentQueue;
 
@@ -396,33 +1030,152 @@ private:
     std::vector<VkShaderModule> modules;
 
     // ========== Sync Objects ==========
-    //Semaphores GPU-GPU Sync
+    //Semaphores GPU-GPU Sync, one of each per frame in flight
     std::vector<VkSemaphore> imageAvailableSemaphores;
     std::vector<VkSemaphore> renderFinishedSemaphores;
-    //Fences CPU-GPU Sync
+    //CPU-GPU Sync, the timeline is signaled with the number of each frame when it finishes
+    bool timelineSemaphores = false;
+    VkSemaphore frameTimeline = VK_NULL_HANDLE;
+    PFN_vkWaitSemaphoresKHR waitSemaphores = nullptr;
+    PFN_vkGetSemaphoreCounterValueKHR getSemaphoreCounterValue = nullptr;
+    //Only used without the timeline, one per frame in flight
     std::vector<VkFence> inFlightFences;
-    std::vector<VkFence> imagesInFlight;
+    //Last frame submitted with each frame in flight and to each swapchain image
+    std::vector<uint64_t> slotFrames;
+    std::vector<uint64_t> imageFrames;
+    uint32_t framesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
+    //Version the instance was created with, 1.2 when the loader has it
+    uint32_t apiVersion = VK_API_VERSION_1_0;
 
     // ========== Vertex Buffer ==========
 
     VkBuffer vertexBuffer = VK_NULL_HANDLE;
-    VkDeviceMemory vertexBufferMemory;
+    MemoryAllocation vertexBufferMemory;
     VkBuffer indexBuffer = VK_NULL_HANDLE;
-    VkDeviceMemory indexBufferMemory;
-
-    VkDeviceSize lastVertexBufferSize;
-    VkDeviceSize lastIndexBufferSize;
+    MemoryAllocation indexBufferMemory;
+
+    VkDeviceSize vertexBufferCapacity = 0;
+    VkDeviceSize indexBufferCapacity = 0;
+
+    //Indexed by gameObjId
+    std::vector<MeshRange> meshRanges;
+    //Ranges of removed objects, their indicies are degenerate
+    std::vector<MeshRange> geometryHoles;
+    //gameObjId of the objects by vertexOffset, the last one is the next to be moved in to a hole
+    //Kept sorted, the rebuild fills it in order and keeps its memory
+    std::vector<std::pair<uint32_t, uint32_t>> objectsByOffset;
+    void insertObjectOffset(uint32_t offset, uint32_t id);
+    void eraseObjectOffset(uint32_t offset);
+    //Regions of the vertices that changed, reused every frame
+    std::vector<VkBufferCopy> changedRegions;
+    //Index regions (in indices) of removed objects made degenerate since the last upload, they go up together in createModelData
+    std::vector<VkBufferCopy> removedIndexRegions;
+
+    //When no mesh is bigger than INDEX_PAGE_SIZE the objects are kept inside pages of that many vertices
+    //and the index buffer holds 16 bit indices relative to the start of the page
+    bool shortIndices = false;
+    //Copy of indicies that is uploaded when shortIndices is set
+    std::vector<uint16_t> shortIndicies;
+    //One per page with objects, or one for everything with 32 bit indices, then one per registered mesh
+    std::vector<DrawBatch> drawBatches;
+    uint64_t drawBatchesVersion = UINT64_MAX;
+
+    struct ObjectSlot {
+        GameObject *obj = nullptr;
+        //Increased when the object is removed so the old handles stop matching
+        uint32_t generation = 0;
+        //Position in gameObjs
+        uint32_t index = 0;
+    };
+    //Indexed by gameObjId
+    std::vector<ObjectSlot> objectSlots;
+    //Position, velocity, accelaration and rotation of the objects
+    TransformStore transforms;
+    //Filled by tick, kept to not allocate every tick
+    std::vector<uint32_t> movedIds;
+
+    //Worker threads for the tick and the mesh building, on the heap so the engine can be moved
+    std::unique_ptr<JobSystem> jobs;
+    //Ids of removed objects to give out again
+    std::vector<uint32_t> freeIds;
+
+    struct SharedMesh {
+        std::vector<Vertex> v;
+        std::vector<uint32_t> i;
+        //They go at the start of the vertex and index buffers, before the objects
+        MeshRange range;
+        uint32_t firstInstance;
+        uint32_t instanceCount;
+        glm::vec4 bounds;
+    };
+    std::vector<SharedMesh> sharedMeshes;
+    MeshHandle quadMesh;
+    //End of the shared meshes in the buffers
+    uint32_t sharedVertexEnd = 0;
+    uint32_t sharedIndexEnd = 0;
 
     /*
             ========== Pipeline ========== 
         */
     VkPipelineLayout pipelineLayout;
     VkPipeline graphicsPipeline;
+    //Used by every pipeline, loaded from PIPELINE_CACHE_FILE when the device is created and saved at cleanup
+    VkPipelineCache pipelineCache = VK_NULL_HANDLE;
 
     std::vector<Shader *> shaders;
 
     // Commands
     std::vector<VkCommandBuffer> commandBuffers;
+    //commandVersion that each command buffer was recorded with
+    std::vector<uint64_t> commandBufferVersions;
+    //Increased when the draw list changes
+    uint64_t geometryVersion = 0;
+    //Increased when something the command buffers point at changes (buffers, descriptor sets, the number of draws)
+    uint64_t commandVersion = 0;
+
+    //The draws are read from a buffer per swapchain image so changing them does not need the command buffers to be recorded again.
+    //Without drawIndirectFirstInstance the instanced draws can not be indirect so the draws are recorded directly
+    bool indirectDraws = false;
+    //Draws the whole buffer with one command, the unused commands draw nothing. Otherwise there is one command per draw
+    bool multiDrawIndirect = false;
+    //limits.maxDrawIndirectCount, a multi draw is split in commands of at most this many draws
+    uint32_t maxDrawIndirectCount = 1;
+    std::vector<VkBuffer> indirectBuffers;
+    std::vector<MemoryAllocation> indirectBuffersMemory;
+    uint32_t indirectCapacity = 0;
+    //geometryVersion that each indirect buffer was written with
+    std::vector<uint64_t> indirectImageVersions;
+
+    // ========== Culling ==========
+    Shader *cullShader = nullptr;
+    VkDescriptorSetLayout cullSetLayout = VK_NULL_HANDLE;
+    VkDescriptorPool cullDescriptorPool = VK_NULL_HANDLE;
+    std::vector<VkDescriptorSet> cullDescriptorSets;
+    VkPipelineLayout cullPipelineLayout = VK_NULL_HANDLE;
+    VkPipeline cullPipeline = VK_NULL_HANDLE;
+    //Built with drawBatches, the culled draws start with no instances and the cull pass adds the visible ones
+    std::vector<CullItem> cullItems;
+    //The host writes the draws here and they are copied to the indirect buffers before the cull pass
+    std::vector<VkBuffer> drawTemplateBuffers;
+    std::vector<MemoryAllocation> drawTemplateBuffersMemory;
+    //A count followed by the items
+    std::vector<VkBuffer> cullItemBuffers;
+    std::vector<MemoryAllocation> cullItemBuffersMemory;
+    uint32_t cullItemCapacity = 0;
+
+    bool cpuCulling = false;
+    glm::mat4 viewProj = glm::mat4(1.0f);
+    Bvh bvh;
+    //Objects were added or removed so the bvh is built again
+    bool bvhDirty = true;
+    //The view or an object moved since the last query
+    bool visibilityChanged = true;
+    //Bounding sphere of each object in its own space, indexed by gameObjId
+    std::vector<glm::vec4> objectSpheres;
+    //Sorted ids of the objects in the view and one flag per gameObjId
+    std::vector<uint32_t> visibleIds;
+    std::vector<uint32_t> queryIds;
+    std::vector<uint8_t> visibleObjects;
     // swapchain
     std::vector<VkImage> swapChainImages;
     std::vector<VkImageView> swapChainImageViews;
@@ -438,30 +1191,106 @@ private:
 
     //Descriptors
     //std::vector<Descriptor *> descriptors;
-    std::vector<UniformBuffer *> unifromBuffers;
+    std::vector<UniformBufferBase *> unifromBuffers;
+    //Persistently mapped memory of all the uniform buffers, the data of each swapchain image is next to each other
+    VkBuffer uniformArena = VK_NULL_HANDLE;
+    MemoryAllocation uniformArenaMemory;
+    //One entry per uniform buffer, in binding order
+    std::vector<std::vector<uint32_t>> uniformDynamicOffsets;
+
+    //0 when the push constants are not used
+    uint32_t pushConstantSize = 0;
+    std::vector<char> pushConstantData;
+    VkShaderStageFlags pushConstantStages();
+    VkPushConstantRange pushConstantRange();
     //std::vector<VkDescriptorSetLayoutBinding> descriptorSetLayoutBindings;
     VkDescriptorSetLayout descriptorSetLayout = VK_NULL_HANDLE;
     VkDescriptorPool descriptorPool;
     std::vector<VkDescriptorSet> descriptorSets;
 
+    //One model matrix per game object, indexed by gameObjId
+    ShaderStorageBuffer<ModelBuffer> modelBuffer;
+    bool gpuTransforms = false;
+    //modelStamp is increased every time a matrix changes
+    uint64_t modelStamp = 0;
+    //Stamp of the last change of each object matrix
+    std::vector<uint64_t> modelStamps;
+    //Stamp of the last update of each swapchain image buffer
+    std::vector<uint64_t> modelImageStamps;
+
+    //gameObjId of every instance grouped by mesh, the shader reads it with gl_InstanceIndex.
+    //The first one is not used so that instance 0 means the draw is not instanced
+    ShaderStorageBuffer<uint32_t> instanceBuffer;
+    std::vector<uint32_t> instanceIds;
+    bool instancesChanged = false;
+    uint64_t instanceVersion = 0;
+    std::vector<uint64_t> instanceImageVersions;
+
     //Can also be used as a transfer queue
     VkCommandPool commandPool = VK_NULL_HANDLE;
 
-    void cleanupPipeline();
+    //All the uploads are staged here
+    StagingRing stagingRing;
+
+    //keepSwapChain is for recreateSwapChain, which already made the new swapchain and cleaned the old views
+    void createPipelineInternal(bool keepSwapChain);
+    void cleanupPipeline(bool keepSwapChain);
+    //Only the swapchain and what has its size are made again, the pipeline uses a dynamic viewport and scissor
+    void recreateSwapChain();
+    void cleanupSwapChain(bool deferred);
 
     void createSwapChainInternal();
     void createRenderpass();
 
     // ----
     void createDescriptorSetLayout();
+    void createUniformArena();
+    void cleanupUniformArena();
     void createDescriptorPool();
     void createDescriptorSets();
+    void writeDescriptorSets();
+    size_t modelBufferCapacity();
+    size_t instanceBufferCapacity();
+    void updateModelMatrices(uint32_t index);
+    void createIndirectBuffers(uint32_t capacity);
+    void cleanupIndirectBuffers(bool deferred);
+    void updateDrawCommands(uint32_t index);
+    bool isCulling();
+    void createCullItemBuffers(uint32_t capacity);
+    void cleanupCullItemBuffers(bool deferred);
+    void createCullDescriptorSets();
+    //The sets of the frames in flight can not be written, new ones are allocated instead
+    void replaceDescriptorSets();
+    void createCullPipeline();
+    void cleanupCullPipeline();
+    void writeCullDescriptorSets();
+    void recordCullPass(size_t index);
+    Aabb getObjectBox(uint32_t id);
+    void cullObjects();
+    bool isVisible(uint32_t id);
 
     void createCommandPool();
     void createDepthResourses();
     void createFramebuffers();
     void createCommandBuffers();
+    void recordCommandBuffer(size_t index);
     void createGraphicsPipeline();
+    void createPipelineCache();
+    void savePipelineCache();
+    // ----
+
+    // Model data ----
+    void rebuildModelData();
+    void updateModelData();
+    void removeGeometry(uint32_t id);
+    bool trimModelData();
+    void uploadRemovedIndices();
+    void compactModelData();
+    void reserveModelBuffer(VkBuffer &buffer, MemoryAllocation &memory, VkDeviceSize &capacity, VkDeviceSize size, VkBufferUsageFlags usage);
+    void copyIndexRegions(UploadBatch &batch, const VkBufferCopy *regions, size_t count);
+    void groupInstances();
+    void updateInstances(uint32_t index);
+    void buildDrawBatches();
     // ----
 
     //Helper funcions
@@ -471,8 +1300,17 @@ private:
             ==== Drawing  ====
         */
     size_t currentFrame = 0;
+    //Frames given to the queue, the resources in the deletion queue are tagged with it
+    uint64_t submittedFrames = 0;
+    //Last frame known to be finished by the gpu
+    uint64_t completedFrames = 0;
+    DeletionQueue deletionQueue;
     bool framebufferResized = false;
     uint32_t imageIndex;
     bool positionChanged = true;
+    //Set when objects are added so the buffers need to be laid out again
+    bool layoutChanged = true;
+    //Open beginObjects calls
+    uint32_t objectTransactions = 0;
     bool hasCurrentImage = false;
 };
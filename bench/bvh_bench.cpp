@@ -0,0 +1,98 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+#include "../UEngine.hpp"
+
+//Times the build, refit and query of the bvh the cpu culling uses, for a few scene sizes
+
+static double msSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+//Same test as the query, one box at a time. The query returns whole leaves so it can return a few more
+static size_t bruteForce(const glm::mat4 &viewProj, const std::vector<Aabb> &boxes) {
+    glm::vec4 rows[4];
+    for (int r = 0; r < 4; r++) {
+        rows[r] = glm::vec4(viewProj[0][r], viewProj[1][r], viewProj[2][r], viewProj[3][r]);
+    }
+    glm::vec4 planes[6] = {rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1], rows[3] - rows[1], rows[2], rows[3] - rows[2]};
+
+    size_t visible = 0;
+    for (auto &box : boxes) {
+        bool outside = false;
+        for (auto &p : planes) {
+            glm::vec3 pos = glm::vec3(p.x >= 0 ? box.high.x : box.low.x, p.y >= 0 ? box.high.y : box.low.y, p.z >= 0 ? box.high.z : box.low.z);
+            if (glm::dot(glm::vec3(p), pos) + p.w < 0.0f) {
+                outside = true;
+                break;
+            }
+        }
+        if (!outside) visible++;
+    }
+    return visible;
+}
+
+static void run(uint32_t count) {
+    std::mt19937 rng(count);
+    //The scene grows with the count so the density stays the same
+    float extent = std::cbrt((float) count) * 10.0f;
+    std::uniform_real_distribution<float> position(-extent, extent);
+    std::uniform_real_distribution<float> size(0.5f, 2.0f);
+    std::uniform_real_distribution<float> step(-1.0f, 1.0f);
+
+    std::vector<Aabb> boxes(count);
+    std::vector<uint32_t> ids(count);
+    for (uint32_t i = 0; i < count; i++) {
+        glm::vec3 c = glm::vec3(position(rng), position(rng), position(rng));
+        glm::vec3 h = glm::vec3(size(rng));
+        boxes[i] = Aabb {c - h, c + h};
+        ids[i] = i;
+    }
+
+    Bvh bvh;
+    auto start = std::chrono::steady_clock::now();
+    bvh.build(ids, boxes);
+    double buildMs = msSince(start);
+
+    //A percent of the objects move a bit every frame
+    const int frames = 10;
+    uint32_t moving = std::max(1u, count / 100);
+    double refitMs = 0.0;
+    for (int f = 0; f < frames; f++) {
+        for (uint32_t m = 0; m < moving; m++) {
+            uint32_t id = rng() % count;
+            glm::vec3 d = glm::vec3(step(rng), step(rng), step(rng));
+            boxes[id] = Aabb {boxes[id].low + d, boxes[id].high + d};
+            bvh.update(id, boxes[id]);
+        }
+        start = std::chrono::steady_clock::now();
+        bvh.refit();
+        refitMs += msSince(start);
+    }
+
+    glm::mat4 proj = glm::perspective(glm::radians(90.0f), 16.0f / 9.0f, 0.1f, extent);
+    glm::mat4 view = glm::lookAt(glm::vec3(0.0f), glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+    glm::mat4 viewProj = proj * view;
+
+    const int queries = 20;
+    std::vector<uint32_t> visible;
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < queries; q++) {
+        bvh.query(viewProj, visible);
+    }
+    double queryMs = msSince(start) / queries;
+
+    start = std::chrono::steady_clock::now();
+    size_t expected = bruteForce(viewProj, boxes);
+    double bruteMs = msSince(start);
+
+    std::cout << count << " objects: build " << buildMs << " ms, refit " << refitMs / frames << " ms (" << moving << " moved), query "
+        << queryMs << " ms (" << visible.size() << " returned), brute force " << bruteMs << " ms (" << expected << " inside)\n";
+}
+
+int main() {
+    for (uint32_t count : {10000u, 100000u, 1000000u}) {
+        run(count);
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include "../UEngine.hpp"
+
+//Times the per object tick (GameObject::tick going through updateVec/updatePos and the matrix stamps)
+//against UniverseEngine::tick with the integration kernel, and checks that the SIMD kernel ends with
+//the same state as the scalar one
+
+static double msSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool sameFloat(float a, float b) {
+    return std::memcmp(&a, &b, sizeof(float)) == 0;
+}
+
+static bool sameVec(glm::vec3 a, glm::vec3 b) {
+    return sameFloat(a.x, b.x) && sameFloat(a.y, b.y) && sameFloat(a.z, b.z);
+}
+
+//An engine without a device, the objects stay in an open transaction so nothing is uploaded
+struct Scene {
+    UniverseEngine engine;
+    std::vector<GameObject> objects;
+
+    Scene(uint32_t count) {
+        //Like main, a moved object only gets its model matrix stamped
+        engine.setGpuTransforms(true);
+        objects.assign(count, GameObject(&engine));
+        engine.beginObjects();
+        for (auto &o : objects) {
+            engine.addGameobject(&o);
+        }
+    }
+};
+
+int main() {
+    //Not a multiple of 8 so the tail runs too
+    const uint32_t count = 1000003;
+    const int steps = 100;
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+
+    Scene perObject(count);
+    Scene batched(count);
+    TransformStore simd;
+    TransformStore scalar;
+    simd.resize(count);
+    scalar.resize(count);
+    scalar.setScalar(true);
+    for (uint32_t i = 0; i < count; i++) {
+        glm::vec3 pos = glm::vec3(value(rng), value(rng), value(rng));
+        //A quarter of them stay still so the dirty bits are not all set
+        bool still = i % 4 == 0;
+        glm::vec3 vec = still ? glm::vec3(0.0f) : glm::vec3(value(rng), value(rng), value(rng));
+        glm::vec3 acc = still ? glm::vec3(0.0f) : glm::vec3(value(rng), value(rng), value(rng)) * 0.01f;
+        for (Scene *s : {&perObject, &batched}) {
+            GameObject &o = s->objects[i];
+            o.updatePos(pos);
+            o.updateVec(vec);
+            o.updateAcc(acc);
+        }
+        simd.set(i, pos, vec, acc, glm::mat4(1.0f));
+        scalar.set(i, pos, vec, acc, glm::mat4(1.0f));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int s = 0; s < steps; s++) {
+        for (auto &o : perObject.objects) {
+            o.tick();
+        }
+    }
+    double perObjectMs = msSince(start) / steps;
+
+    //The default engine runs the jobs on this thread, so this is the kernel and the moved objects on one core
+    start = std::chrono::steady_clock::now();
+    for (int s = 0; s < steps; s++) {
+        batched.engine.tick();
+    }
+    double engineMs = msSince(start) / steps;
+
+    std::vector<uint32_t> scalarMoved;
+    start = std::chrono::steady_clock::now();
+    for (int s = 0; s < steps; s++) {
+        scalar.integrate(scalarMoved);
+    }
+    double scalarMs = msSince(start) / steps;
+
+    std::vector<uint32_t> simdMoved;
+    start = std::chrono::steady_clock::now();
+    for (int s = 0; s < steps; s++) {
+        simd.integrate(simdMoved);
+    }
+    double simdMs = msSince(start) / steps;
+
+    std::cout << count << " objects, per step: GameObject::tick " << perObjectMs << " ms, UniverseEngine::tick " << engineMs
+        << " ms, scalar kernel " << scalarMs << " ms, simd kernel " << simdMs << " ms\n";
+
+    uint32_t mismatches = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        glm::vec3 p = simd.getPos(i);
+        if (!sameVec(p, scalar.getPos(i)) || !sameVec(simd.getVec(i), scalar.getVec(i))) {
+            mismatches++;
+            continue;
+        }
+        //The per object tick does the same adds in the same order
+        if (!sameVec(p, perObject.objects[i].getPos()) || !sameVec(p, batched.objects[i].getPos()))
+            mismatches++;
+    }
+    if (simdMoved != scalarMoved) {
+        std::cout << "the kernels moved different objects\n";
+        return 1;
+    }
+    if (mismatches != 0) {
+        std::cout << mismatches << " objects differ between the kernels\n";
+        return 1;
+    }
+    std::cout << "the simd and scalar kernels match, " << simdMoved.size() << " objects moved\n";
+    return 0;
+}
@@ -0,0 +1,224 @@
+#include <stdexcept>
+#include "../UEngine.hpp"
+
+//Objects per leaf
+#define BVH_LEAF_SIZE 4
+//Buckets the centers are sorted in to when looking for the best split
+#define BVH_BINS 12
+
+static Aabb emptyBox() {
+    return Aabb {glm::vec3(INFINITY), glm::vec3(-INFINITY)};
+}
+
+static Aabb merge(const Aabb &a, const Aabb &b) {
+    return Aabb {glm::min(a.low, b.low), glm::max(a.high, b.high)};
+}
+
+static float area(const Aabb &a) {
+    glm::vec3 d = a.high - a.low;
+    if (d.x < 0.0f) return 0.0f;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static bool sameBox(const Aabb &a, const Aabb &b) {
+    return a.low == b.low && a.high == b.high;
+}
+
+void Bvh::build(const std::vector<uint32_t> &ids, const std::vector<Aabb> &boxes) {
+    this->boxes = boxes;
+    items = ids;
+    nodes.clear();
+    dirtyLeaves.clear();
+    leafOf.assign(boxes.size(), UINT32_MAX);
+    if (items.empty()) return;
+
+    std::vector<glm::vec3> centers(boxes.size());
+    for (auto id : items) {
+        centers[id] = (boxes[id].low + boxes[id].high) * 0.5f;
+    }
+
+    nodes.reserve(2 * items.size() / BVH_LEAF_SIZE + 1);
+    nodes.push_back(Node {emptyBox(), 0, 0, 0, static_cast<uint32_t>(items.size()), UINT32_MAX});
+
+    //Split the nodes until the leaves are small, the children are added at the end
+    std::vector<uint32_t> stack = {0};
+    while (!stack.empty()) {
+        uint32_t n = stack.back();
+        stack.pop_back();
+
+        Aabb box = emptyBox();
+        for (uint32_t i = nodes[n].first; i < nodes[n].first + nodes[n].count; i++) {
+            box = merge(box, this->boxes[items[i]]);
+        }
+        nodes[n].box = box;
+
+        uint32_t mid = nodes[n].count > BVH_LEAF_SIZE ? split(nodes[n].first, nodes[n].count, centers) : 0;
+        if (mid == 0) {
+            for (uint32_t i = nodes[n].first; i < nodes[n].first + nodes[n].count; i++) {
+                leafOf[items[i]] = n;
+            }
+            continue;
+        }
+
+        uint32_t first = nodes[n].first;
+        uint32_t count = nodes[n].count;
+        uint32_t left = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(Node {emptyBox(), 0, 0, first, mid, n});
+        nodes.push_back(Node {emptyBox(), 0, 0, first + mid, count - mid, n});
+        nodes[n].left = left;
+        nodes[n].right = left + 1;
+        stack.push_back(left);
+        stack.push_back(left + 1);
+    }
+    leafDirty.assign(nodes.size(), 0);
+}
+
+// Sorts the items of the range by the best split, returns how many go left or 0 when it is better as a leaf
+uint32_t Bvh::split(uint32_t first, uint32_t count, std::vector<glm::vec3> &centers) {
+    Aabb bounds = emptyBox();
+    for (uint32_t i = first; i < first + count; i++) {
+        bounds.low = glm::min(bounds.low, centers[items[i]]);
+        bounds.high = glm::max(bounds.high, centers[items[i]]);
+    }
+
+    float bestCost = INFINITY;
+    int bestAxis = -1;
+    int bestBin = 0;
+
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = bounds.high[axis] - bounds.low[axis];
+        if (extent <= 0.0f) continue;
+
+        Aabb binBoxes[BVH_BINS];
+        uint32_t binCounts[BVH_BINS] = {};
+        for (int b = 0; b < BVH_BINS; b++) binBoxes[b] = emptyBox();
+
+        for (uint32_t i = first; i < first + count; i++) {
+            int b = std::min(BVH_BINS - 1, (int) ((centers[items[i]][axis] - bounds.low[axis]) / extent * BVH_BINS));
+            binBoxes[b] = merge(binBoxes[b], boxes[items[i]]);
+            binCounts[b]++;
+        }
+
+        //Areas of everything right of each split, then sweep from the left
+        float rightArea[BVH_BINS];
+        uint32_t rightCount[BVH_BINS];
+        Aabb acc = emptyBox();
+        uint32_t c = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--) {
+            acc = merge(acc, binBoxes[b]);
+            c += binCounts[b];
+            rightArea[b] = area(acc);
+            rightCount[b] = c;
+        }
+
+        acc = emptyBox();
+        c = 0;
+        for (int b = 0; b < BVH_BINS - 1; b++) {
+            acc = merge(acc, binBoxes[b]);
+            c += binCounts[b];
+            if (c == 0 || rightCount[b + 1] == 0) continue;
+            float cost = area(acc) * c + rightArea[b + 1] * rightCount[b + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    //All the centers are in the same place, split in the middle
+    if (bestAxis == -1) return count / 2;
+
+    //Not splitting costs the area of the node times all the items
+    Aabb box = emptyBox();
+    for (uint32_t i = first; i < first + count; i++) box = merge(box, boxes[items[i]]);
+    if (count <= BVH_LEAF_SIZE * 4 && bestCost >= area(box) * count) return 0;
+
+    float extent = bounds.high[bestAxis] - bounds.low[bestAxis];
+    auto middle = std::partition(items.begin() + first, items.begin() + first + count, [&](uint32_t id) {
+        int b = std::min(BVH_BINS - 1, (int) ((centers[id][bestAxis] - bounds.low[bestAxis]) / extent * BVH_BINS));
+        return b <= bestBin;
+    });
+    return static_cast<uint32_t>(middle - (items.begin() + first));
+}
+
+void Bvh::update(uint32_t id, Aabb box) {
+    if (id >= leafOf.size() || leafOf[id] == UINT32_MAX) return;
+    boxes[id] = box;
+    uint32_t leaf = leafOf[id];
+    if (leafDirty[leaf]) return;
+    leafDirty[leaf] = 1;
+    dirtyLeaves.push_back(leaf);
+}
+
+void Bvh::refit() {
+    for (auto leaf : dirtyLeaves) {
+        leafDirty[leaf] = 0;
+        Node &n = nodes[leaf];
+        Aabb box = emptyBox();
+        for (uint32_t i = n.first; i < n.first + n.count; i++) {
+            box = merge(box, boxes[items[i]]);
+        }
+        n.box = box;
+
+        //Up to the root, or until a parent is not changed by it
+        uint32_t p = n.parent;
+        while (p != UINT32_MAX) {
+            Aabb parentBox = merge(nodes[nodes[p].left].box, nodes[nodes[p].right].box);
+            if (sameBox(parentBox, nodes[p].box)) break;
+            nodes[p].box = parentBox;
+            p = nodes[p].parent;
+        }
+    }
+    dirtyLeaves.clear();
+}
+
+void Bvh::query(const glm::mat4 &viewProj, std::vector<uint32_t> &visible) {
+    visible.clear();
+    if (nodes.empty()) return;
+
+    //Planes of the frustum from the rows of the matrix, the depth goes from 0 to 1
+    glm::vec4 rows[4];
+    for (int r = 0; r < 4; r++) {
+        rows[r] = glm::vec4(viewProj[0][r], viewProj[1][r], viewProj[2][r], viewProj[3][r]);
+    }
+    glm::vec4 planes[6] = {rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1], rows[3] - rows[1], rows[2], rows[3] - rows[2]};
+
+    std::vector<uint32_t> stack = {0};
+    while (!stack.empty()) {
+        uint32_t n = stack.back();
+        stack.pop_back();
+        const Aabb &box = nodes[n].box;
+
+        bool inside = true;
+        bool outside = false;
+        for (auto &p : planes) {
+            //Corner furthest along the normal, and the one furthest against it
+            glm::vec3 pos = glm::vec3(p.x >= 0 ? box.high.x : box.low.x, p.y >= 0 ? box.high.y : box.low.y, p.z >= 0 ? box.high.z : box.low.z);
+            glm::vec3 neg = glm::vec3(p.x >= 0 ? box.low.x : box.high.x, p.y >= 0 ? box.low.y : box.high.y, p.z >= 0 ? box.low.z : box.high.z);
+            if (glm::dot(glm::vec3(p), pos) + p.w < 0.0f) {
+                outside = true;
+                break;
+            }
+            if (glm::dot(glm::vec3(p), neg) + p.w < 0.0f) inside = false;
+        }
+        if (outside) continue;
+
+        //Everything under a node that is fully inside is visible, same for a leaf that is partly inside
+        if (inside || nodes[n].left == 0) {
+            addItems(n, visible);
+        } else {
+            stack.push_back(nodes[n].left);
+            stack.push_back(nodes[n].right);
+        }
+    }
+}
+
+// The leaves of a subtree are the range of items the node keeps
+void Bvh::addItems(uint32_t node, std::vector<uint32_t> &visible) {
+    visible.insert(visible.end(), items.begin() + nodes[node].first, items.begin() + nodes[node].first + nodes[node].count);
+}
+
+size_t Bvh::size() {
+    return items.size();
+}
@@ -0,0 +1,25 @@
+#include <stdexcept>
+#include "../UEngine.hpp"
+
+void DeletionQueue::push(uint64_t frame, std::function<void()> destroy) {
+    entries.push_back(Entry {frame, std::move(destroy)});
+}
+
+void DeletionQueue::flush(uint64_t frame) {
+    //They are pushed in frame order so the ones that are done are at the front
+    while (!entries.empty() && entries.front().frame <= frame) {
+        entries.front().destroy();
+        entries.pop_front();
+    }
+}
+
+void DeletionQueue::flushAll() {
+    while (!entries.empty()) {
+        entries.front().destroy();
+        entries.pop_front();
+    }
+}
+
+size_t DeletionQueue::size() {
+    return entries.size();
+}
@@ -1,8 +1,11 @@
-#include <iostream>
 #include "../UEngine.hpp"
 
 GameObject::GameObject() {
+    pos = glm::vec3(0.0f);
+    vec = glm::vec3(0.0f);
+    acc = glm::vec3(0.0f);
     rot = glm::mat4(1.0f);
+    meshChanged = true;
 };
 GameObject::GameObject(UniverseEngine * e) : GameObject() { 
     this->e = e; 
@@ -12,17 +15,23 @@ GameObject::GameObject(UniverseEngine * e, std::vector<Vertex> vertices, std::ve
     this->vertecies = vertices;
     this->indicies = indicies;
     this->pos = glm::vec4(pos, 1.0f);
+    this->vec = glm::vec3(0.0f);
+    this->acc = glm::vec3(0.0f);
+    this->rot = glm::mat4(1.0f);
+    this->meshChanged = true;
+}
+GameObject::GameObject(UniverseEngine * e, MeshHandle mesh, glm::vec3 pos) : GameObject(e) {
+    this->mesh = mesh;
+    this->pos = pos;
 }
 void GameObject::tick(void) {
-    std::cout << "acc: " << printVec3(acc) << "\n";
-    vec = vec + acc;
-    std::cout << "vec: " << printVec3(vec) << "\n";
-    updatePos(this->pos + vec);
+    updateVec(getVec() + getAcc());
+    updatePos(getPos() + getVec());
 }
 void GameObject::tick(glm::vec3 a) {
-    acc = acc + a;
-    vec = vec + acc;
-    updatePos(this->pos + vec);
+    updateAcc(getAcc() + a);
+    updateVec(getVec() + getAcc());
+    updatePos(getPos() + getVec());
 }
 void GameObject::updateVerticeId() {
     for (size_t i = 0; i < vertecies.size(); i++) {
@@ -30,41 +39,96 @@ void GameObject::updateVerticeId() {
     }
 }
 void GameObject::updatePos(glm::vec3 pos) {
-    if (this->pos == pos) return;
-    this->pos = pos;
-    meshChanged = true;
-    e->recreateModel();
+    if (getPos() == pos) return;
+    if (id == UINT32_MAX) {
+        this->pos = pos;
+    } else {
+        e->getTransforms()->setPos(id, pos);
+    }
+    transformChanged();
 }
 void GameObject::updateVec(glm::vec3 vec) {
-    this->vec = vec;
+    if (id == UINT32_MAX) {
+        this->vec = vec;
+    } else {
+        e->getTransforms()->setVec(id, vec);
+    }
 }
 void GameObject::updateAcc(glm::vec3 acc) {
-    this->acc = acc;
+    if (id == UINT32_MAX) {
+        this->acc = acc;
+    } else {
+        e->getTransforms()->setAcc(id, acc);
+    }
 }
 
 void GameObject::updateRot(glm::mat4 rot) {
-    if (rot == this->rot) return;
-    this->rot = rot;
-    this->meshChanged = true;
-    this->e->recreateModel();
+    if (rot == getRot()) return;
+    if (id == UINT32_MAX) {
+        this->rot = rot;
+    } else {
+        e->getTransforms()->setRot(id, rot);
+    }
+    transformChanged();
+}
+
+void GameObject::setColor(glm::vec3 color) {
+    this->color = color;
+    if (isInstanced()) e->updateModelMatrix(id);
+}
+
+void GameObject::setScale(glm::vec3 scale) {
+    this->scale = scale;
+    transformChanged();
+}
+
+void GameObject::transformChanged() {
+    e->objectMoved(id);
+    //With gpu transforms the vertices stay the same and only the matrix is uploaded
+    if (e->getGpuTransforms() || isInstanced()) {
+        e->updateModelMatrix(id);
+        return;
+    }
+    meshChanged = true;
+    e->recreateModel();
 }
 
 glm::vec3 GameObject::getPos() {
-    return pos;
+    if (id == UINT32_MAX) return pos;
+    return e->getTransforms()->getPos(id);
 }
 glm::vec3 GameObject::getVec() {
-    return vec;
+    if (id == UINT32_MAX) return vec;
+    return e->getTransforms()->getVec(id);
 }
 glm::vec3 GameObject::getAcc() {
-    return acc;
+    if (id == UINT32_MAX) return acc;
+    return e->getTransforms()->getAcc(id);
+}
+glm::mat4 GameObject::getRot() {
+    if (id == UINT32_MAX) return rot;
+    return e->getTransforms()->getRot(id);
+}
+
+glm::vec3 GameObject::getColor() { return color; }
+glm::vec3 GameObject::getScale() { return scale; }
+MeshHandle GameObject::getMeshHandle() { return mesh; }
+bool GameObject::isInstanced() { return mesh.id != UINT32_MAX; }
+
+glm::mat4 GameObject::getModelMatrix() {
+    return glm::translate(glm::mat4(1.0f), getPos()) * getRot() * glm::scale(glm::mat4(1.0f), scale);
 }
 
 Mesh GameObject::getMesh() {
     Mesh m {};
+    if (e->getGpuTransforms()) {
+        m.i = indicies;
+        m.v = vertecies;
+        return m;
+    }
     size_t v = vertecies.size();
     std::vector<Vertex> a(v);
-    glm::mat4 model = glm::translate(glm::mat4(1.0f), pos);
-    model = model * rot;
+    glm::mat4 model = getModelMatrix();
     for (auto i = 0; i < v; i++) {
         Vertex v = vertecies[i];
         v.pos = glm::vec3(model * glm::vec4(v.pos, 1.0f));
@@ -75,11 +139,79 @@ Mesh GameObject::getMesh() {
     return m;
 }
 
+void GameObject::transformInto(GpuVertex *dst, uint32_t *idst, uint32_t base) {
+    if (e->getGpuTransforms()) {
+        for (size_t i = 0; i < vertecies.size(); i++) {
+            packVertex(vertecies[i], dst[i]);
+        }
+    } else {
+        glm::mat4 model = getModelMatrix();
+        for (size_t i = 0; i < vertecies.size(); i++) {
+            Vertex v = vertecies[i];
+            v.pos = glm::vec3(model * glm::vec4(v.pos, 1.0f));
+            packVertex(v, dst[i]);
+        }
+    }
+
+    if (idst == nullptr) return;
+    for (size_t i = 0; i < indicies.size(); i++) {
+        idst[i] = indicies[i] + base;
+    }
+}
+
+glm::vec4 getBoundingSphere(const std::vector<Vertex> &vertecies) {
+    if (vertecies.empty()) return glm::vec4(0.0f);
+
+    //Center of the box around the vertices, not the smallest sphere but close enough for culling
+    glm::vec3 low = vertecies[0].pos;
+    glm::vec3 high = vertecies[0].pos;
+    for (auto &v : vertecies) {
+        low = glm::min(low, v.pos);
+        high = glm::max(high, v.pos);
+    }
+    glm::vec3 center = (low + high) * 0.5f;
+
+    float radius = 0.0f;
+    for (auto &v : vertecies) {
+        radius = std::max(radius, glm::length(v.pos - center));
+    }
+    return glm::vec4(center, radius);
+}
+
+glm::vec4 GameObject::getBounds() {
+    return getBoundingSphere(vertecies);
+}
+
+uint32_t GameObject::getVertexCount() {
+    return static_cast<uint32_t>(vertecies.size());
+}
+
+uint32_t GameObject::getIndexCount() {
+    return static_cast<uint32_t>(indicies.size());
+}
+
 bool GameObject::hasMeshChanged() {
     return meshChanged;
 }
 
+void GameObject::clearMeshChanged() {
+    meshChanged = false;
+}
+
 void GameObject::setId(uint32_t id) {
+    //The state moves to the engine store when the object is added and back when it is removed
+    if (this->id == UINT32_MAX && id != UINT32_MAX) {
+        e->getTransforms()->set(id, pos, vec, acc, rot);
+    } else if (this->id != UINT32_MAX && id == UINT32_MAX) {
+        TransformStore *t = e->getTransforms();
+        pos = t->getPos(this->id);
+        vec = t->getVec(this->id);
+        acc = t->getAcc(this->id);
+        rot = t->getRot(this->id);
+    }
     this->id = id;
     updateVerticeId();
-}
\ No newline at end of file
+}
+uint32_t GameObject::getId() {
+    return id;
+}
@@ -0,0 +1,216 @@
+#include <stdexcept>
+#include "../UEngine.hpp"
+
+//Queue of the thread, the threads that are not workers push to queue 0
+thread_local size_t JobSystem::queueIndex = 0;
+
+JobSystem::JobSystem() {}
+JobSystem::~JobSystem() {
+    cleanUp();
+}
+
+void JobSystem::create(uint32_t threadCount) {
+    if (running) return;
+
+    if (threadCount == 0) {
+        //The thread that waits for the jobs also runs them
+        uint32_t cores = std::thread::hardware_concurrency();
+        threadCount = cores > 1 ? cores - 1 : 0;
+    }
+
+    for (uint32_t i = 0; i < threadCount + 1; i++) {
+        queues.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+
+    running = true;
+    for (uint32_t i = 0; i < threadCount; i++) {
+        threads.push_back(std::thread(&JobSystem::workerLoop, this, i + 1));
+    }
+}
+
+void JobSystem::cleanUp() {
+    if (!running) return;
+
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        running = false;
+    }
+    wake.notify_all();
+    for (auto &t : threads) {
+        t.join();
+    }
+    threads.clear();
+    queues.clear();
+    parked.clear();
+}
+
+void JobSystem::run(std::function<void()> job, JobCounter *counter, JobCounter *dependency) {
+    if (counter != nullptr) counter->pending++;
+
+    if (queues.empty()) {
+        //Not created, run it here
+        if (dependency != nullptr) wait(dependency);
+        job();
+        if (counter != nullptr) counter->pending--;
+        return;
+    }
+
+    Job j {};
+    j.fn = std::move(job);
+    j.counter = counter;
+    j.dependency = dependency;
+
+    //Waits out of the queues until the last job of the dependency is done, so the workers do not pick it up over and over
+    if (dependency != nullptr) {
+        std::lock_guard<std::mutex> lock(parkMutex);
+        if (dependency->pending.load() != 0) {
+            parked.push_back(std::move(j));
+            return;
+        }
+    }
+    enqueue(std::move(j));
+}
+
+void JobSystem::enqueue(Job job) {
+    {
+        //Under the lock so a worker can not check the count and go to sleep between this and the notify
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        queued++;
+    }
+    Worker &w = *queues[queueIndex];
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.jobs.push_back(std::move(job));
+    }
+    wake.notify_one();
+}
+
+void JobSystem::wait(JobCounter *counter) {
+    while (counter->pending.load() != 0) {
+        if (!runOne(queueIndex)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void JobSystem::parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)> &fn) {
+    if (count == 0) return;
+    grain = std::max((size_t) 1, grain);
+
+    //Not worth sending to other threads
+    if (count <= grain || threads.empty()) {
+        fn(0, count);
+        return;
+    }
+
+    //Each job takes chunks until there are none left. The jobs only hold a pointer to the state,
+    //so they fit inside the std::function and making them does not allocate
+    ForState state;
+    state.fn = &fn;
+    state.count = count;
+    state.grain = grain;
+
+    size_t chunks = (count + grain - 1) / grain;
+    size_t jobCount = std::min(chunks, (size_t) getThreadCount());
+
+    JobCounter counter;
+    ForState *s = &state;
+    for (size_t j = 0; j < jobCount; j++) {
+        run([s]() { runChunks(*s); }, &counter);
+    }
+    //The jobs do not throw, so this only returns once none of them uses the state anymore
+    wait(&counter);
+
+    if (state.error)
+        std::rethrow_exception(state.error);
+}
+
+void JobSystem::runChunks(ForState &state) {
+    try {
+        while (true) {
+            size_t begin = state.next.fetch_add(state.grain);
+            if (begin >= state.count) return;
+            (*state.fn)(begin, std::min(state.count, begin + state.grain));
+        }
+    } catch (...) {
+        //The other jobs stop taking chunks
+        std::lock_guard<std::mutex> lock(state.errorMutex);
+        if (!state.error)
+            state.error = std::current_exception();
+        state.next = state.count;
+    }
+}
+
+uint32_t JobSystem::getThreadCount() {
+    return static_cast<uint32_t>(threads.size()) + 1;
+}
+
+// Takes a job from the own queue (newest first) or steals one from another queue (oldest first)
+bool JobSystem::runOne(size_t self) {
+    Job job;
+    bool found = false;
+
+    for (size_t i = 0; i < queues.size() && !found; i++) {
+        size_t q = (self + i) % queues.size();
+        Worker &w = *queues[q];
+        std::lock_guard<std::mutex> lock(w.mutex);
+        if (w.head == w.jobs.size()) continue;
+
+        if (q == self) {
+            job = std::move(w.jobs.back());
+            w.jobs.pop_back();
+        } else {
+            job = std::move(w.jobs[w.head]);
+            w.head++;
+        }
+        //Starts from the front again once it is empty, clear keeps the capacity
+        if (w.head == w.jobs.size()) {
+            w.jobs.clear();
+            w.head = 0;
+        }
+        //Taken while the queue is locked, so it can not go below the jobs that are left
+        queued--;
+        found = true;
+    }
+    if (!found) return false;
+
+    job.fn();
+    if (job.counter != nullptr && --job.counter->pending == 0) release(job.counter);
+    return true;
+}
+
+//Queues the parked jobs that were waiting for the counter
+void JobSystem::release(JobCounter *counter) {
+    std::vector<Job> ready;
+    {
+        //The parking checks the counter with this lock held, so a job can not be parked after this ran
+        std::lock_guard<std::mutex> lock(parkMutex);
+        if (parked.empty()) return;
+        for (size_t i = 0; i < parked.size();) {
+            if (parked[i].dependency == counter) {
+                ready.push_back(std::move(parked[i]));
+                parked[i] = std::move(parked.back());
+                parked.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+    for (auto &j : ready) {
+        enqueue(std::move(j));
+    }
+}
+
+void JobSystem::workerLoop(size_t index) {
+    queueIndex = index;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this]() { return queued.load() > 0 || !running; });
+            if (!running) return;
+        }
+        if (!runOne(index)) {
+            std::this_thread::yield();
+        }
+    }
+}
@@ -0,0 +1,302 @@
+#include <stdexcept>
+#include <iostream>
+#include "../UEngine.hpp"
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+MemoryAllocator::MemoryAllocator() {}
+MemoryAllocator::MemoryAllocator(VkPhysicalDevice phyDevice, VkDevice device) {
+    this->phyDevice = phyDevice;
+    this->device = device;
+}
+
+void MemoryAllocator::create() {
+    vkGetPhysicalDeviceMemoryProperties(phyDevice, &memProperties);
+
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(phyDevice, &props);
+    granularity = std::max((VkDeviceSize) 1, props.limits.bufferImageGranularity);
+    nonCoherentAtom = std::max((VkDeviceSize) 1, props.limits.nonCoherentAtomSize);
+    maxAllocations = props.limits.maxMemoryAllocationCount;
+
+    driverAllocations = 0;
+    pools.clear();
+}
+
+void MemoryAllocator::cleanUp() {
+    for (auto &pool : pools) {
+        for (auto &block : pool.blocks) {
+            if (block.memory != VK_NULL_HANDLE) {
+                releaseBlock(block);
+            }
+        }
+    }
+    pools.clear();
+}
+
+MemoryAllocation MemoryAllocator::allocate(VkMemoryRequirements reqs, VkMemoryPropertyFlags props, bool linear, MemoryStrategy strategy) {
+    uint32_t type = findMemoryType(phyDevice, reqs.memoryTypeBits, props);
+    VkMemoryPropertyFlags typeFlags = memProperties.memoryTypes[type].propertyFlags;
+
+    VkDeviceSize alignment = std::max((VkDeviceSize) 1, reqs.alignment);
+    //Non coherent memory is flushed in atoms so allocations can not share them
+    if ((typeFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && !(typeFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+        alignment = std::max(alignment, nonCoherentAtom);
+    }
+
+    //Buffers and linear images can not share a granularity page with optimal images,
+    //when the device has such pages they are kept in different pools
+    if (granularity == 1) linear = true;
+
+    uint32_t poolIndex = getPool(type, linear, strategy);
+    Pool &pool = pools[poolIndex];
+    VkDeviceSize blockSize = getBlockSize(type, strategy);
+
+    MemoryAllocation allocation {};
+    allocation.memoryType = type;
+    allocation.pool = poolIndex;
+    allocation.size = reqs.size;
+
+    //Big resources get their own block so that they do not waste the shared ones
+    if (reqs.size > blockSize / 2) {
+        allocation.block = addBlock(pool, reqs.size, true);
+        Block &block = pool.blocks[allocation.block];
+        block.freeRanges.clear();
+        block.head = reqs.size;
+        block.allocations = 1;
+        block.used = reqs.size;
+
+        allocation.memory = block.memory;
+        allocation.offset = 0;
+        allocation.mapped = block.mapped;
+        return allocation;
+    }
+
+    for (uint32_t i = 0; i < pool.blocks.size(); i++) {
+        Block &block = pool.blocks[i];
+        if (block.memory == VK_NULL_HANDLE || block.dedicated) continue;
+        if (suballocate(pool, block, reqs.size, alignment, allocation.offset)) {
+            allocation.block = i;
+            allocation.memory = block.memory;
+            allocation.mapped = block.mapped == nullptr ? nullptr : block.mapped + allocation.offset;
+            return allocation;
+        }
+    }
+
+    allocation.block = addBlock(pool, blockSize, false);
+    Block &block = pool.blocks[allocation.block];
+    if (!suballocate(pool, block, reqs.size, alignment, allocation.offset)) {
+        throw std::runtime_error("failed to suballocate from a new memory block");
+    }
+    allocation.memory = block.memory;
+    allocation.mapped = block.mapped == nullptr ? nullptr : block.mapped + allocation.offset;
+    return allocation;
+}
+
+void MemoryAllocator::free(MemoryAllocation &allocation) {
+    if (allocation.memory == VK_NULL_HANDLE) return;
+
+    Pool &pool = pools[allocation.pool];
+    Block &block = pool.blocks[allocation.block];
+
+    block.allocations--;
+    block.used -= allocation.size;
+
+    if (pool.strategy == MEMORY_STRATEGY_FREE_LIST && !block.dedicated) {
+        Range range {allocation.offset, allocation.size};
+        auto it = std::lower_bound(block.freeRanges.begin(), block.freeRanges.end(), range, [](const Range &a, const Range &b) { return a.offset < b.offset; });
+        it = block.freeRanges.insert(it, range);
+
+        //Merge with the next and the previous ranges
+        auto next = it + 1;
+        if (next != block.freeRanges.end() && it->offset + it->size == next->offset) {
+            it->size += next->size;
+            block.freeRanges.erase(next);
+        }
+        if (it != block.freeRanges.begin()) {
+            auto prev = it - 1;
+            if (prev->offset + prev->size == it->offset) {
+                prev->size += it->size;
+                block.freeRanges.erase(it);
+            }
+        }
+    }
+
+    if (block.allocations == 0) {
+        //Linear blocks are reused from the start once everything in them was freed
+        block.head = 0;
+
+        //Keep one empty block around so that freeing and allocating again does not go to the driver
+        bool hasSpare = false;
+        for (auto &b : pool.blocks) {
+            if (&b != &block && b.memory != VK_NULL_HANDLE && !b.dedicated && b.allocations == 0) hasSpare = true;
+        }
+        if (block.dedicated || hasSpare) {
+            releaseBlock(block);
+        }
+    }
+
+    allocation = MemoryAllocation {};
+}
+
+bool MemoryAllocator::suballocate(Pool &pool, Block &block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize &offset) {
+    if (pool.strategy == MEMORY_STRATEGY_LINEAR) {
+        VkDeviceSize start = alignUp(block.head, alignment);
+        if (start + size > block.size) return false;
+
+        block.head = start + size;
+        block.allocations++;
+        block.used += size;
+        offset = start;
+        return true;
+    }
+
+    //Best fit, the smallest range that fits is split
+    size_t best = block.freeRanges.size();
+    VkDeviceSize bestLeft = 0;
+    for (size_t i = 0; i < block.freeRanges.size(); i++) {
+        Range &r = block.freeRanges[i];
+        VkDeviceSize start = alignUp(r.offset, alignment);
+        if (start + size > r.offset + r.size) continue;
+
+        VkDeviceSize left = r.offset + r.size - start - size;
+        if (best == block.freeRanges.size() || left < bestLeft) {
+            best = i;
+            bestLeft = left;
+        }
+    }
+    if (best == block.freeRanges.size()) return false;
+
+    Range r = block.freeRanges[best];
+    VkDeviceSize start = alignUp(r.offset, alignment);
+    block.freeRanges.erase(block.freeRanges.begin() + best);
+
+    //The padding before the allocation and what is left after stay free
+    if (start + size < r.offset + r.size) {
+        block.freeRanges.insert(block.freeRanges.begin() + best, Range {start + size, r.offset + r.size - start - size});
+    }
+    if (start > r.offset) {
+        block.freeRanges.insert(block.freeRanges.begin() + best, Range {r.offset, start - r.offset});
+    }
+
+    block.allocations++;
+    block.used += size;
+    offset = start;
+    return true;
+}
+
+uint32_t MemoryAllocator::getPool(uint32_t memoryType, bool linear, MemoryStrategy strategy) {
+    for (uint32_t i = 0; i < pools.size(); i++) {
+        if (pools[i].memoryType == memoryType && pools[i].linear == linear && pools[i].strategy == strategy) return i;
+    }
+    Pool pool {};
+    pool.memoryType = memoryType;
+    pool.linear = linear;
+    pool.strategy = strategy;
+    pools.push_back(pool);
+    return static_cast<uint32_t>(pools.size() - 1);
+}
+
+VkDeviceSize MemoryAllocator::getBlockSize(uint32_t memoryType, MemoryStrategy strategy) {
+    //Small heaps (like the host visible device local one) would be used up by a few blocks
+    VkDeviceSize heapSize = memProperties.memoryHeaps[memProperties.memoryTypes[memoryType].heapIndex].size;
+    VkDeviceSize size = std::min((VkDeviceSize) MEMORY_BLOCK_SIZE, heapSize / 8);
+    //Linear blocks only hold short lived groups of resources
+    if (strategy == MEMORY_STRATEGY_LINEAR) size /= 8;
+    return size;
+}
+
+uint32_t MemoryAllocator::addBlock(Pool &pool, VkDeviceSize size, bool dedicated) {
+    if (driverAllocations >= maxAllocations) {
+        throw std::runtime_error("reached maxMemoryAllocationCount");
+    }
+
+    VkMemoryAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = size;
+    allocInfo.memoryTypeIndex = pool.memoryType;
+
+    Block block {};
+    if (vkAllocateMemory(device, &allocInfo, nullptr, &block.memory) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate device memory");
+    }
+    driverAllocations++;
+
+    block.size = size;
+    block.dedicated = dedicated;
+    block.freeRanges.push_back(Range {0, size});
+
+    //Host visible blocks stay mapped, the allocations just point inside them
+    if (memProperties.memoryTypes[pool.memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        void *data;
+        vkMapMemory(device, block.memory, 0, VK_WHOLE_SIZE, 0, &data);
+        block.mapped = (char *) data;
+    }
+
+    //Reuse the slot of a released block so the indices of the allocations stay valid
+    for (uint32_t i = 0; i < pool.blocks.size(); i++) {
+        if (pool.blocks[i].memory == VK_NULL_HANDLE) {
+            pool.blocks[i] = block;
+            return i;
+        }
+    }
+    pool.blocks.push_back(block);
+    return static_cast<uint32_t>(pool.blocks.size() - 1);
+}
+
+void MemoryAllocator::releaseBlock(Block &block) {
+    if (block.mapped != nullptr) {
+        vkUnmapMemory(device, block.memory);
+    }
+    vkFreeMemory(device, block.memory, nullptr);
+    driverAllocations--;
+    block = Block {};
+}
+
+MemoryStats MemoryAllocator::getStats() {
+    return getStats(UINT32_MAX);
+}
+
+MemoryStats MemoryAllocator::getStats(uint32_t memoryType) {
+    MemoryStats stats {};
+    VkDeviceSize totalFree = 0;
+    for (auto &pool : pools) {
+        if (memoryType != UINT32_MAX && pool.memoryType != memoryType) continue;
+        for (auto &block : pool.blocks) {
+            if (block.memory == VK_NULL_HANDLE) continue;
+            stats.blockCount++;
+            stats.allocationCount += block.allocations;
+            stats.bytesAllocated += block.size;
+            stats.bytesUsed += block.used;
+
+            if (block.dedicated) continue;
+            if (pool.strategy == MEMORY_STRATEGY_LINEAR) {
+                totalFree += block.size - block.head;
+                stats.largestFreeRange = std::max(stats.largestFreeRange, block.size - block.head);
+            } else {
+                for (auto &r : block.freeRanges) {
+                    totalFree += r.size;
+                    stats.largestFreeRange = std::max(stats.largestFreeRange, r.size);
+                }
+            }
+        }
+    }
+    if (totalFree != 0) {
+        stats.fragmentation = 1.0f - (float) stats.largestFreeRange / (float) totalFree;
+    }
+    return stats;
+}
+
+void MemoryAllocator::printStats() {
+    for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+        MemoryStats s = getStats(i);
+        if (s.blockCount == 0) continue;
+        std::cout << "memory type " << i << ": " << s.blockCount << " blocks, " << s.allocationCount << " allocations, "
+            << s.bytesUsed << "/" << s.bytesAllocated << " bytes used, fragmentation " << s.fragmentation << "\n";
+    }
+}
+
+VkDevice MemoryAllocator::getDevice() { return device; }
+VkPhysicalDevice MemoryAllocator::getPhyDevice() { return phyDevice; }
@@ -0,0 +1,125 @@
+#include <stdexcept>
+#include "../UEngine.hpp"
+
+StagingRing::StagingRing() {}
+StagingRing::StagingRing(UniverseEngine *en, VkDeviceSize size) {
+    this->en = en;
+    this->size = size;
+}
+
+void StagingRing::create() {
+    createBuffer(en->getAllocator(), size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, buffer, memory);
+
+    //The allocator keeps host visible memory mapped
+    mapped = (char *) memory.mapped;
+
+    head = 0;
+    tail = 0;
+    openStart = 0;
+}
+
+void StagingRing::cleanUp() {
+    if (buffer == VK_NULL_HANDLE) return;
+
+    VkDevice device = en->getDevice();
+
+    while (!inFlight.empty()) {
+        waitOldest();
+    }
+    for (auto f : freeFences) {
+        vkDestroyFence(device, f, nullptr);
+    }
+    freeFences.clear();
+
+    destroyBuffer(en->getAllocator(), buffer, memory);
+    mapped = nullptr;
+}
+
+StagingAllocation StagingRing::allocate(VkDeviceSize allocSize, VkDeviceSize alignment) {
+    if (buffer == VK_NULL_HANDLE) {
+        throw std::runtime_error("the staging ring has not been created");
+    }
+    if (allocSize > size) {
+        throw std::runtime_error("the upload is bigger than the staging ring");
+    }
+
+    reclaim();
+
+    //head and tail only grow, the offset in the buffer is the position modulo the size
+    VkDeviceSize offset = (head + alignment - 1) / alignment * alignment;
+    //Does not fit before the end of the buffer so wrap around to the start
+    if (offset % size + allocSize > size) {
+        offset = (offset / size + 1) * size;
+    }
+
+    //Back-pressure: wait for the gpu to finish with the oldest regions
+    while (offset + allocSize - tail > size) {
+        if (inFlight.empty()) {
+            throw std::runtime_error("the staging ring is full, retire the allocations before allocating more");
+        }
+        waitOldest();
+    }
+
+    head = offset + allocSize;
+
+    StagingAllocation a {};
+    a.buffer = buffer;
+    a.offset = offset % size;
+    a.data = mapped + a.offset;
+    return a;
+}
+
+VkFence StagingRing::retire(VkCommandBuffer commandBuffer) {
+    if (head == openStart && commandBuffer == VK_NULL_HANDLE) return VK_NULL_HANDLE;
+
+    VkFence fence;
+    if (!freeFences.empty()) {
+        fence = freeFences.back();
+        freeFences.pop_back();
+    } else {
+        VkFenceCreateInfo info {};
+        info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        if (vkCreateFence(en->getDevice(), &info, nullptr, &fence) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create the staging fence");
+        }
+    }
+
+    Region r {};
+    r.end = head;
+    r.fence = fence;
+    r.commandBuffer = commandBuffer;
+    inFlight.push_back(r);
+    openStart = head;
+
+    return fence;
+}
+
+//Frees the regions whose submissions are already done without blocking
+void StagingRing::reclaim() {
+    while (!inFlight.empty() && vkGetFenceStatus(en->getDevice(), inFlight.front().fence) == VK_SUCCESS) {
+        waitOldest();
+    }
+    //Nothing is in use so start again from the beginning of the buffer
+    if (inFlight.empty() && head == openStart) {
+        head = 0;
+        tail = 0;
+        openStart = 0;
+    }
+}
+
+void StagingRing::waitOldest() {
+    Region r = inFlight.front();
+    inFlight.pop_front();
+
+    vkWaitForFences(en->getDevice(), 1, &r.fence, VK_TRUE, UINT64_MAX);
+    vkResetFences(en->getDevice(), 1, &r.fence);
+    freeFences.push_back(r.fence);
+    if (r.commandBuffer != VK_NULL_HANDLE) {
+        vkFreeCommandBuffers(en->getDevice(), en->getCommandPool(), 1, &r.commandBuffer);
+    }
+
+    tail = r.end;
+}
+
+VkBuffer StagingRing::getBuffer() { return buffer; }
+VkDeviceSize StagingRing::getSize() { return size; }
@@ -0,0 +1,196 @@
+#include <stdexcept>
+#include "../UEngine.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+void TransformStore::resize(size_t count) {
+    posX.resize(count, 0.0f);
+    posY.resize(count, 0.0f);
+    posZ.resize(count, 0.0f);
+    vecX.resize(count, 0.0f);
+    vecY.resize(count, 0.0f);
+    vecZ.resize(count, 0.0f);
+    accX.resize(count, 0.0f);
+    accY.resize(count, 0.0f);
+    accZ.resize(count, 0.0f);
+    rot.resize(count, glm::mat4(1.0f));
+    dirty.resize((count + 7) / 8, 0);
+}
+
+size_t TransformStore::size() {
+    return posX.size();
+}
+
+void TransformStore::set(uint32_t id, glm::vec3 pos, glm::vec3 vec, glm::vec3 acc, glm::mat4 rot) {
+    setPos(id, pos);
+    setVec(id, vec);
+    setAcc(id, acc);
+    setRot(id, rot);
+}
+
+void TransformStore::clear(uint32_t id) {
+    set(id, glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(0.0f), glm::mat4(1.0f));
+}
+
+//Arrays the kernels work on, dirty gets one bit per object
+struct IntegrateArgs {
+    float *px, *py, *pz;
+    float *vx, *vy, *vz;
+    const float *ax, *ay, *az;
+    uint8_t *dirty;
+    size_t n;
+};
+
+typedef void (*IntegrateKernel)(IntegrateArgs &a);
+
+//Objects from start to the end one at a time, start must be a multiple of 8
+static void integrateTail(IntegrateArgs &a, size_t start) {
+    for (size_t i = start; i < a.n; i++) {
+        a.vx[i] += a.ax[i];
+        a.vy[i] += a.ay[i];
+        a.vz[i] += a.az[i];
+        a.px[i] += a.vx[i];
+        a.py[i] += a.vy[i];
+        a.pz[i] += a.vz[i];
+
+        if (i % 8 == 0) a.dirty[i / 8] = 0;
+        if (a.vx[i] != 0.0f || a.vy[i] != 0.0f || a.vz[i] != 0.0f)
+            a.dirty[i / 8] |= 1 << (i % 8);
+    }
+}
+
+static void integrateScalar(IntegrateArgs &a) {
+    integrateTail(a, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void integrateSse(IntegrateArgs &a) {
+    size_t end = a.n - a.n % 8;
+    __m128 zero = _mm_setzero_ps();
+    for (size_t i = 0; i < end; i += 8) {
+        int mask = 0;
+        //Two batches of 4 fill one byte of dirty bits
+        for (size_t j = i; j < i + 8; j += 4) {
+            __m128 vx = _mm_add_ps(_mm_loadu_ps(a.vx + j), _mm_loadu_ps(a.ax + j));
+            __m128 vy = _mm_add_ps(_mm_loadu_ps(a.vy + j), _mm_loadu_ps(a.ay + j));
+            __m128 vz = _mm_add_ps(_mm_loadu_ps(a.vz + j), _mm_loadu_ps(a.az + j));
+            _mm_storeu_ps(a.vx + j, vx);
+            _mm_storeu_ps(a.vy + j, vy);
+            _mm_storeu_ps(a.vz + j, vz);
+            _mm_storeu_ps(a.px + j, _mm_add_ps(_mm_loadu_ps(a.px + j), vx));
+            _mm_storeu_ps(a.py + j, _mm_add_ps(_mm_loadu_ps(a.py + j), vy));
+            _mm_storeu_ps(a.pz + j, _mm_add_ps(_mm_loadu_ps(a.pz + j), vz));
+
+            __m128 moving = _mm_or_ps(_mm_or_ps(_mm_cmpneq_ps(vx, zero), _mm_cmpneq_ps(vy, zero)), _mm_cmpneq_ps(vz, zero));
+            mask |= _mm_movemask_ps(moving) << (j - i);
+        }
+        a.dirty[i / 8] = (uint8_t) mask;
+    }
+    integrateTail(a, end);
+}
+
+__attribute__((target("avx2")))
+static void integrateAvx2(IntegrateArgs &a) {
+    size_t end = a.n - a.n % 8;
+    __m256 zero = _mm256_setzero_ps();
+    for (size_t i = 0; i < end; i += 8) {
+        __m256 vx = _mm256_add_ps(_mm256_loadu_ps(a.vx + i), _mm256_loadu_ps(a.ax + i));
+        __m256 vy = _mm256_add_ps(_mm256_loadu_ps(a.vy + i), _mm256_loadu_ps(a.ay + i));
+        __m256 vz = _mm256_add_ps(_mm256_loadu_ps(a.vz + i), _mm256_loadu_ps(a.az + i));
+        _mm256_storeu_ps(a.vx + i, vx);
+        _mm256_storeu_ps(a.vy + i, vy);
+        _mm256_storeu_ps(a.vz + i, vz);
+        _mm256_storeu_ps(a.px + i, _mm256_add_ps(_mm256_loadu_ps(a.px + i), vx));
+        _mm256_storeu_ps(a.py + i, _mm256_add_ps(_mm256_loadu_ps(a.py + i), vy));
+        _mm256_storeu_ps(a.pz + i, _mm256_add_ps(_mm256_loadu_ps(a.pz + i), vz));
+
+        __m256 moving = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(vx, zero, _CMP_NEQ_UQ), _mm256_cmp_ps(vy, zero, _CMP_NEQ_UQ)), _mm256_cmp_ps(vz, zero, _CMP_NEQ_UQ));
+        a.dirty[i / 8] = (uint8_t) _mm256_movemask_ps(moving);
+    }
+    integrateTail(a, end);
+}
+#endif
+
+//Picks the widest kernel the cpu can run
+static IntegrateKernel selectKernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return integrateAvx2;
+    if (__builtin_cpu_supports("sse2")) return integrateSse;
+#endif
+    return integrateScalar;
+}
+
+void TransformStore::integrate(std::vector<uint32_t> &moved) {
+    integrateRange(0, size());
+    collectMoved(moved);
+}
+
+void TransformStore::integrateRange(size_t begin, size_t end) {
+    static const IntegrateKernel kernel = selectKernel();
+
+    //Every range writes its own bytes of dirty bits
+    if (begin % 8 != 0)
+        throw std::runtime_error("the integration range must start at a multiple of 8");
+
+    IntegrateArgs a {};
+    a.px = posX.data() + begin;
+    a.py = posY.data() + begin;
+    a.pz = posZ.data() + begin;
+    a.vx = vecX.data() + begin;
+    a.vy = vecY.data() + begin;
+    a.vz = vecZ.data() + begin;
+    a.ax = accX.data() + begin;
+    a.ay = accY.data() + begin;
+    a.az = accZ.data() + begin;
+    a.n = end - begin;
+
+    a.dirty = dirty.data() + begin / 8;
+
+    if (scalar) {
+        integrateScalar(a);
+    } else {
+        kernel(a);
+    }
+}
+
+void TransformStore::setScalar(bool scalar) {
+    this->scalar = scalar;
+}
+
+void TransformStore::collectMoved(std::vector<uint32_t> &moved) {
+    moved.clear();
+    for (size_t b = 0; b < dirty.size(); b++) {
+        unsigned int bits = dirty[b];
+        while (bits != 0) {
+            moved.push_back(static_cast<uint32_t>(b * 8 + __builtin_ctz(bits)));
+            bits &= bits - 1;
+        }
+    }
+}
+
+glm::vec3 TransformStore::getPos(uint32_t id) { return glm::vec3(posX[id], posY[id], posZ[id]); }
+glm::vec3 TransformStore::getVec(uint32_t id) { return glm::vec3(vecX[id], vecY[id], vecZ[id]); }
+glm::vec3 TransformStore::getAcc(uint32_t id) { return glm::vec3(accX[id], accY[id], accZ[id]); }
+glm::mat4 TransformStore::getRot(uint32_t id) { return rot[id]; }
+
+void TransformStore::setPos(uint32_t id, glm::vec3 pos) {
+    posX[id] = pos.x;
+    posY[id] = pos.y;
+    posZ[id] = pos.z;
+}
+void TransformStore::setVec(uint32_t id, glm::vec3 vec) {
+    vecX[id] = vec.x;
+    vecY[id] = vec.y;
+    vecZ[id] = vec.z;
+}
+void TransformStore::setAcc(uint32_t id, glm::vec3 acc) {
+    accX[id] = acc.x;
+    accY[id] = acc.y;
+    accZ[id] = acc.z;
+}
+void TransformStore::setRot(uint32_t id, glm::mat4 rot) {
+    this->rot[id] = rot;
+}
@@ -0,0 +1,159 @@
+#include <stdexcept>
+#include "../UEngine.hpp"
+
+UploadBatch::UploadBatch() {}
+UploadBatch::UploadBatch(UniverseEngine *en) {
+    this->en = en;
+}
+
+UploadBatch::~UploadBatch() {
+    if (commandBuffer == VK_NULL_HANDLE) return;
+
+    //Never submitted (an exception left the batch half recorded) so the commands are dropped.
+    //The staged bytes go back to the ring with the next retire
+    vkEndCommandBuffer(commandBuffer);
+    vkFreeCommandBuffers(en->getDevice(), en->getCommandPool(), 1, &commandBuffer);
+}
+
+void UploadBatch::copyToBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void *data, VkDeviceSize size) {
+    VkBufferCopy region {};
+    region.srcOffset = 0;
+    region.dstOffset = dstOffset;
+    region.size = size;
+    copyRegions(dst, data, &region, 1);
+}
+
+void UploadBatch::copyRegions(VkBuffer dst, const void *src, const std::vector<VkBufferCopy> &regions) {
+    copyRegions(dst, src, regions.data(), regions.size());
+}
+
+void UploadBatch::copyRegions(VkBuffer dst, const void *src, const VkBufferCopy *regions, size_t count) {
+    //Half of the ring is staged before submitting so that the next half can be filled while it is copied
+    VkDeviceSize chunkSize = en->getStagingRing()->getSize() / 2;
+
+    //The copies are recorded a few at a time so nothing is allocated for them
+    std::array<VkBufferCopy, 16> copies;
+
+    size_t r = 0;
+    VkDeviceSize done = 0;
+    while (r < count && regions[r].size == 0) r++;
+    while (r < count) {
+        if (staged >= chunkSize) submit();
+
+        //Size of the chunk
+        VkDeviceSize size = 0;
+        for (size_t c = r; c < count && size < chunkSize - staged; c++) {
+            size += (c == r) ? regions[c].size - done : regions[c].size;
+        }
+        size = std::min(size, chunkSize - staged);
+
+        StagingAllocation staging = stage(size, 16);
+
+        uint32_t copyCount = 0;
+        VkDeviceSize offset = 0;
+        while (offset < size) {
+            VkBufferCopy &c = copies[copyCount++];
+            c.size = std::min(regions[r].size - done, size - offset);
+            c.srcOffset = staging.offset + offset;
+            c.dstOffset = regions[r].dstOffset + done;
+            memcpy((char *) staging.data + offset, (const char *) src + regions[r].srcOffset + done, (size_t) c.size);
+
+            offset += c.size;
+            done += c.size;
+            if (done == regions[r].size) {
+                r++;
+                done = 0;
+                while (r < count && regions[r].size == 0) r++;
+            }
+
+            if (copyCount == copies.size() || offset == size) {
+                vkCmdCopyBuffer(commandBuffer, staging.buffer, dst, copyCount, copies.data());
+                copyCount = 0;
+            }
+        }
+    }
+}
+
+void UploadBatch::changeLayout(MImage *image, VkImageLayout newLayout) {
+    begin();
+    image->changeLayout(commandBuffer, newLayout);
+}
+
+void UploadBatch::uploadImage(MImage *image, const void *pixels, VkDeviceSize size) {
+    uint32_t height = image->getHeight();
+    if (height == 0 || size == 0) return;
+
+    //No allocation can be bigger than what is staged before a submit, so big images go a group of rows at a time
+    VkDeviceSize rowSize = size / height;
+    VkDeviceSize chunkSize = en->getStagingRing()->getSize() / 2;
+    if (rowSize > chunkSize) {
+        throw std::runtime_error("a row of the image is bigger than half the staging ring");
+    }
+    uint32_t rowsPerChunk = static_cast<uint32_t>(std::min((VkDeviceSize) height, chunkSize / rowSize));
+
+    begin();
+    image->changeLayout(commandBuffer, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    for (uint32_t row = 0; row < height; row += rowsPerChunk) {
+        uint32_t rows = std::min(rowsPerChunk, height - row);
+        //The offset must be a multiple of the texel size
+        StagingAllocation staging = stage(rowSize * rows, 16);
+        memcpy(staging.data, (const char *) pixels + rowSize * row, (size_t) (rowSize * rows));
+        recordBufferToImage(commandBuffer, image->getWidth(), rows, staging.buffer, image->getImage(), staging.offset, row);
+    }
+    image->changeLayout(commandBuffer, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+}
+
+void UploadBatch::submit() {
+    if (commandBuffer == VK_NULL_HANDLE) return;
+
+    //Make the copies visible to the draws submitted after
+    VkMemoryBarrier barrier {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    vkEndCommandBuffer(commandBuffer);
+
+    //The ring frees the command buffer and the staged data when the fence is signaled
+    VkFence fence = en->getStagingRing()->retire(commandBuffer);
+
+    VkSubmitInfo submitInfo {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+
+    if (vkQueueSubmit(en->getGraphicsQueue(), 1, &submitInfo, fence) != VK_SUCCESS) {
+        throw std::runtime_error("failed to submit the upload batch");
+    }
+
+    commandBuffer = VK_NULL_HANDLE;
+    staged = 0;
+}
+
+bool UploadBatch::isEmpty() {
+    return commandBuffer == VK_NULL_HANDLE;
+}
+
+void UploadBatch::begin() {
+    if (commandBuffer != VK_NULL_HANDLE) return;
+
+    commandBuffer = beginSingleCommands(en->getDevice(), en->getCommandPool());
+
+    //Frames that were already submitted might still read the buffers that are about to be written
+    vkCmdPipelineBarrier(commandBuffer,
+        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0, 0, nullptr, 0, nullptr, 0, nullptr);
+}
+
+StagingAllocation UploadBatch::stage(VkDeviceSize size, VkDeviceSize alignment) {
+    //The ring can not hand out more than it has while this batch is still open
+    if (staged != 0 && staged + size > en->getStagingRing()->getSize() / 2) {
+        submit();
+    }
+    begin();
+    staged += size;
+    return en->getStagingRing()->allocate(size, alignment);
+}
@@ -29,11 +29,7 @@ const std::vector<const char*> deviceExtensions = {
 
 class UniverseApp {
     public:
-        UniverseApp() {
-            p = PaneObject(&this->uniEngine, glm::vec3(0.0f, 0.0f, 0.0f), glm::vec2(10.f, 10.0f), glm::vec3(0.5f, 0.5f, 0.5f));
-            p1 = PaneObject(&this->uniEngine, glm::vec3(0.0f, 0.0f, 2.0f), glm::vec2(10.f, 10.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-            p1.updateRot(glm::rotate(glm::mat4(1.0f), glm::radians(30.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
-        }
+        UniverseApp() {}
         void run() {
             #ifdef NDEBUG
             #else
@@ -54,10 +50,11 @@ class UniverseApp {
         MImage textureImage;
         MSampler textureSampler;
 
-        UniformBuffer ub;
+        UniformBuffer<UniformBufferObject> ub;
 
         Shader vertShader;
         Shader fragShader;
+        Shader cullShader;
 
         PaneObject p = PaneObject();
         PaneObject p1 = PaneObject();
@@ -91,11 +88,16 @@ class UniverseApp {
             uniEngine.addDeviceExtencions(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 
             uniEngine.getDevices();
+
+            //The panes register the quad mesh, so they are made once the engine is the one that draws them
+            p = PaneObject(&this->uniEngine, glm::vec3(0.0f, 0.0f, 0.0f), glm::vec2(10.f, 10.0f), glm::vec3(0.5f, 0.5f, 0.5f));
+            p1 = PaneObject(&this->uniEngine, glm::vec3(0.0f, 0.0f, 2.0f), glm::vec2(10.f, 10.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+            p1.updateRot(glm::rotate(glm::mat4(1.0f), glm::radians(30.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
             
 
             //Stuff to send to the buffers
 
-            ub = UniformBuffer(&uniEngine ,VK_SHADER_STAGE_VERTEX_BIT);
+            ub = UniformBuffer<UniformBufferObject>(&uniEngine ,VK_SHADER_STAGE_VERTEX_BIT);
             //uniEngine.addDescriptor(&ub);
             uniEngine.addUniformBuffer(&ub);
 
@@ -111,11 +113,18 @@ class UniverseApp {
             uniEngine.addShader(&vertShader);
             fragShader = Shader(&uniEngine, "shaders/frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT);
             uniEngine.addShader(&fragShader);
+            cullShader = Shader(&uniEngine, "shaders/cull.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+            uniEngine.enableCulling(&cullShader);
 
             uniEngine.lockPipelineData();
 
-            uniEngine.addGameobject(&p);
-            uniEngine.addGameobject(&p1);
+            //The camera goes in the push constants instead of the uniform buffer when the device can, usesPushConstants tells which
+            uniEngine.enablePushConstants(sizeof(glm::mat4));
+
+            //Moving objects only uploads their model matrix
+            uniEngine.setGpuTransforms(true);
+
+            uniEngine.addGameobjects({&p, &p1});
 
             uniEngine.createPipeline();
 
@@ -136,31 +145,16 @@ class UniverseApp {
             if (!pixels) {
                 throw std::runtime_error("failed to load texture");
             }
-            VkBuffer stagingBuffer;
-            VkDeviceMemory stagingBufferMemory;
-            createBuffer(device, physicalDevice, imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-            void* data;
-            vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-                memcpy(data, pixels, static_cast<size_t>(imageSize));
-            vkUnmapMemory(device, stagingBufferMemory);
-
-            stbi_image_free(pixels);
-
             MImage textureImageTemp( static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight), VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
 
             textureImage = textureImageTemp;
 
-            textureImage.create(device, physicalDevice);
+            textureImage.create(uniEngine.getAllocator());
 
-            textureImage.changeLayout(device, graphicsQueue, commandPool, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+            //Goes through the engine staging ring
+            uniEngine.uploadImage(&textureImage, pixels, imageSize);
 
-            copyBufferToImage(device, commandPool, graphicsQueue, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight), stagingBuffer, textureImage.getImage());
-
-            textureImage.changeLayout(device, graphicsQueue, commandPool, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-
-            //Clean up
-            vkDestroyBuffer(device, stagingBuffer, nullptr);
-            vkFreeMemory(device, stagingBufferMemory, nullptr);
+            stbi_image_free(pixels);
         }
 
 */
@@ -293,7 +287,14 @@ class UniverseApp {
 
             ubo.proj = glm::perspective(glm::radians(100.0f), uniEngine.getExtent().width / (float) uniEngine.getExtent().width, 0.1f, 50.0f);
 
-            ub.updateUniformBuffer(imageIndex, ubo);
+            glm::mat4 viewProj = ubo.proj * ubo.view;
+            if (uniEngine.usesPushConstants()) {
+                uniEngine.setPushConstants(&viewProj, sizeof(viewProj));
+            } else {
+                ub.updateUniformBuffer(imageIndex, ubo);
+            }
+            //Used by the cpu culling of the next frame
+            uniEngine.setViewProjection(viewProj);
         }
 
         void cleanup() {
@@ -22,13 +22,38 @@ layout(binding = 0) uniform UniformBufferObject {
     mat4 model[1];
 } ubo; 
 
+//Set by the engine when the camera comes in the push constants instead of the uniform buffer
+layout(constant_id = 0) const bool PUSH_CONSTANTS = false;
+
+layout(push_constant) uniform PushConstants {
+    mat4 viewProj;
+} push;
+
+struct Model {
+    mat4 model;
+    vec4 color;
+};
+
+//Model matrix of each game object, identity when the engine bakes the transforms on the cpu
+layout(std430, binding = 1) readonly buffer ModelBuffer {
+    Model model[];
+} models;
+
+//Object of each instance, the instanced draws start at instance 1
+layout(std430, binding = 2) readonly buffer InstanceBuffer {
+    uint id[];
+} instances;
+
 void main() {
     //vec3 a = inPosition;
     //a.z = a.z + gameobj;/*a.z + gameobj*/;
     //a.z = a.z + 1;
-    gl_Position =  ubo.proj * ubo.view * vec4(inPosition, 1.0);
+    bool instanced = gl_InstanceIndex != 0;
+    uint obj = instanced ? instances.id[gl_InstanceIndex] : gameobj;
+    mat4 viewProj = PUSH_CONSTANTS ? push.viewProj : ubo.proj * ubo.view;
+    gl_Position =  viewProj * models.model[obj].model * vec4(inPosition, 1.0);
     //gl_Position = vec4(inPosition, 1.0);
-    fragColor = inColor;
+    fragColor = instanced ? models.model[obj].color.rgb : inColor;
     fragPos = inFragPos;
     cout = c;
 }
@@ -0,0 +1,126 @@
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include "../UEngine.hpp"
+
+//Every allocation of the process goes through here
+static std::atomic<size_t> allocations {0};
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+static int failures = 0;
+
+static void check(const char *name, size_t count) {
+    std::cout << name << ": " << count << " allocations\n";
+    if (count != 0) failures++;
+}
+
+//A cube, the objects only differ in where they are
+static GameObject makeObject(UniverseEngine *e, float x) {
+    std::vector<Vertex> v;
+    for (int i = 0; i < 8; i++) {
+        Vertex vert {};
+        vert.pos = glm::vec3(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+        vert.color = glm::vec3(1.0f);
+        v.push_back(vert);
+    }
+    std::vector<uint32_t> idx = {0, 1, 2, 2, 1, 3, 4, 5, 6, 6, 5, 7, 0, 1, 4, 4, 1, 5, 2, 3, 6, 6, 3, 7};
+    return GameObject(e, v, idx, glm::vec3(x, 0.0f, 0.0f));
+}
+
+int main() {
+    const int objectCount = 1000;
+    const int rounds = 10;
+
+    //The layout runs without a device
+    UniverseEngine engine;
+    std::vector<GameObject> objects;
+    objects.reserve(objectCount);
+    std::vector<GameObject *> pointers;
+    for (int i = 0; i < objectCount; i++) {
+        objects.push_back(makeObject(&engine, (float) i));
+        pointers.push_back(&objects.back());
+    }
+
+    //Left open so adding does not try to upload
+    engine.beginObjects();
+    engine.addGameobjects(pointers);
+
+    //The first rebuild sizes the containers, the ones after it should reuse them
+    engine.layoutModelData();
+    size_t before = allocations.load();
+    for (int r = 0; r < rounds; r++) {
+        engine.layoutModelData();
+    }
+    check("layoutModelData", allocations.load() - before);
+    if (engine.vertecies.size() != objectCount * 8 || engine.indicies.size() != objectCount * 24) {
+        std::cout << "layoutModelData left out meshes\n";
+        failures++;
+    }
+
+    //The cubes are small so the index buffer gets 16 bit indices, the whole buffer goes up after a rebuild
+    //and the ranges of removed objects after that
+    VkBufferCopy all {0, 0, engine.indicies.size()};
+    std::vector<VkBufferCopy> removed;
+    for (int i = 0; i < objectCount; i += 3) {
+        removed.push_back({(VkDeviceSize) i * 24, (VkDeviceSize) i * 24, 24});
+    }
+    engine.packIndexRegions(&all, 1);
+    before = allocations.load();
+    const void *src = nullptr;
+    for (int r = 0; r < rounds; r++) {
+        src = engine.packIndexRegions(&all, 1);
+        src = engine.packIndexRegions(removed.data(), removed.size());
+    }
+    check("packIndexRegions", allocations.load() - before);
+    if (src == engine.indicies.data()) {
+        std::cout << "the cubes did not get 16 bit indices\n";
+        failures++;
+    } else {
+        const uint16_t *shortIdx = static_cast<const uint16_t *>(src);
+        for (size_t i = 0; i < engine.indicies.size(); i++) {
+            if (shortIdx[i] != engine.indicies[i] % INDEX_PAGE_SIZE) {
+                std::cout << "packIndexRegions wrote the wrong 16 bit index\n";
+                failures++;
+                break;
+            }
+        }
+    }
+
+    //Same for the parallelFor the layout uses, with worker threads this time
+    JobSystem jobs;
+    jobs.create(4);
+    std::vector<uint32_t> data(100000, 0);
+    auto fn = [&data](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) data[i]++;
+    };
+    std::function<void(size_t, size_t)> f = fn;
+    jobs.parallelFor(data.size(), 1000, f);
+    before = allocations.load();
+    for (int r = 0; r < rounds; r++) {
+        jobs.parallelFor(data.size(), 1000, f);
+    }
+    check("parallelFor", allocations.load() - before);
+    jobs.cleanUp();
+
+    for (auto d : data) {
+        if (d != rounds + 1) {
+            std::cout << "parallelFor skipped items\n";
+            failures++;
+            break;
+        }
+    }
+
+    return failures == 0 ? 0 : 1;
+}
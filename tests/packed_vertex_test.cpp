@@ -0,0 +1,65 @@
+#include <cmath>
+#include <iostream>
+#include "../UEngine.hpp"
+
+//Built with PACKED_VERTICES=1, checks that the layout writes PackedVertex and that it reads back as the Vertex it came from
+
+#if !PACKED_VERTICES
+#error "packed_vertex_test has to be built with PACKED_VERTICES=1"
+#endif
+
+static int failures = 0;
+
+static void expect(bool ok, const char *what) {
+    if (ok) return;
+    std::cout << what << "\n";
+    failures++;
+}
+
+int main() {
+    static_assert(sizeof(GpuVertex) == 24, "the vertex buffer should hold 24 byte vertices");
+    expect(GpuVertexFormat::getBindingDescription().stride == 24, "the binding stride is not the packed size");
+
+    //The layout runs without a device
+    UniverseEngine engine;
+    //The vertices stay in object space so they can be compared to the mesh
+    engine.setGpuTransforms(true);
+
+    std::vector<Vertex> mesh;
+    for (int i = 0; i < 4; i++) {
+        Vertex v {};
+        v.pos = glm::vec3((float) i, 0.5f, -2.0f);
+        v.color = glm::vec3(i / 3.0f, 1.0f, 0.0f);
+        v.texCoord = glm::vec2(i * 0.25f, 1.0f);
+        v.colorOn = i % 2 == 0 ? 1.0f : -1.0f;
+        mesh.push_back(v);
+    }
+    std::vector<GameObject> objects;
+    for (int o = 0; o < 3; o++) {
+        objects.push_back(GameObject(&engine, mesh, {0, 1, 2, 1, 2, 3}, glm::vec3(0.0f)));
+    }
+
+    //Left open so adding does not try to upload
+    engine.beginObjects();
+    for (auto &o : objects) {
+        engine.addGameobject(&o);
+    }
+    engine.layoutModelData();
+
+    expect(engine.vertecies.size() == objects.size() * mesh.size(), "the layout left out vertices");
+    for (size_t i = 0; i < engine.vertecies.size() && i < objects.size() * mesh.size(); i++) {
+        const PackedVertex &p = engine.vertecies[i];
+        const Vertex &v = mesh[i % mesh.size()];
+        glm::vec4 color = glm::unpackUnorm4x8(p.color);
+        glm::vec2 uv = glm::unpackHalf2x16(p.texCoord);
+
+        expect(p.pos[0] == v.pos.x && p.pos[1] == v.pos.y && p.pos[2] == v.pos.z, "the position changed");
+        expect(std::fabs(color.x - v.color.x) <= 0.5f / 255.0f && color.y == 1.0f && color.z == 0.0f, "the color is off by more than the 8 bit rounding");
+        //Quarters are exact in half floats
+        expect(uv.x == v.texCoord.x && uv.y == v.texCoord.y, "the uvs changed");
+        expect((p.colorOn < 0) == (v.colorOn < 0.0f), "colorOn has the wrong sign");
+        expect(p.gameObjId == objects[i / mesh.size()].getId(), "the vertex has the wrong object id");
+    }
+
+    return failures == 0 ? 0 : 1;
+}